@@ -1,320 +1,831 @@
 #pragma once
 
-struct BVHNode
+// Based on Slab method, as described on https://tavianator.com/fast-branchless-raybounding-box-intersections/
+// Returns the entry distance, which is negative when the origin lies inside the bounds, or FLT_MAX on a miss.
+// The fourth lane of the bounds is ignored, so it can hold other data.
+inline float rayIntersectsBounds( const __m128 bmin4, const __m128 bmax4, const Ray &r )
 {
-	aabb bounds;
-	bool isLeaf;
-	BVHNode *left, *right;
-	vector<Primitive *> primitives;
+	const __m128 t1 = _mm_mul_ps( _mm_sub_ps( bmin4, r.origin4 ), r.invDirection4 );
+	const __m128 t2 = _mm_mul_ps( _mm_sub_ps( bmax4, r.origin4 ), r.invDirection4 );
+	const __m128 vmin = _mm_min_ps( t1, t2 );
+	const __m128 vmax = _mm_max_ps( t1, t2 );
+
+	// Reduce the x, y and z lanes
+	const __m128 tmin = _mm_max_ss( vmin, _mm_max_ss( _mm_shuffle_ps( vmin, vmin, _MM_SHUFFLE( 1, 1, 1, 1 ) ), _mm_movehl_ps( vmin, vmin ) ) );
+	const __m128 tmax = _mm_min_ss( vmax, _mm_min_ss( _mm_shuffle_ps( vmax, vmax, _MM_SHUFFLE( 1, 1, 1, 1 ) ), _mm_movehl_ps( vmax, vmax ) ) );
+
+	const float tnear = _mm_cvtss_f32( tmin );
+	const float tfar = _mm_cvtss_f32( tmax );
+	return ( tfar >= tnear && tfar > 0.f ) ? tnear : FLT_MAX;
+}
+
+// Interval version of the slab test for a coherent packet, see "Faster Ray Packets - Triangle Intersection through Vertex Culling" by Reshetov.
+// Returns a lower bound on the entry distance of all rays, or FLT_MAX when none of them can hit the bounds.
+inline float packetIntersectsBounds( const __m128 bmin4, const __m128 bmax4, const RayPacket &p )
+{
+	// The rays share their direction signs, so they share the near and far plane of every axis
+	const __m128 nearPlane = _mm_or_ps( _mm_and_ps( p.signMask4, bmax4 ), _mm_andnot_ps( p.signMask4, bmin4 ) );
+	const __m128 farPlane = _mm_or_ps( _mm_and_ps( p.signMask4, bmin4 ), _mm_andnot_ps( p.signMask4, bmax4 ) );
+
+	// Interval products: the smallest entry and the largest exit distance over all origins and directions
+	const __m128 n0 = _mm_sub_ps( nearPlane, p.omin4 ), n1 = _mm_sub_ps( nearPlane, p.omax4 );
+	const __m128 f0 = _mm_sub_ps( farPlane, p.omin4 ), f1 = _mm_sub_ps( farPlane, p.omax4 );
+	const __m128 vmin = _mm_min_ps( _mm_min_ps( _mm_mul_ps( n0, p.imin4 ), _mm_mul_ps( n0, p.imax4 ) ), _mm_min_ps( _mm_mul_ps( n1, p.imin4 ), _mm_mul_ps( n1, p.imax4 ) ) );
+	const __m128 vmax = _mm_max_ps( _mm_max_ps( _mm_mul_ps( f0, p.imin4 ), _mm_mul_ps( f0, p.imax4 ) ), _mm_max_ps( _mm_mul_ps( f1, p.imin4 ), _mm_mul_ps( f1, p.imax4 ) ) );
+
+	// Reduce the x, y and z lanes
+	const __m128 tmin = _mm_max_ss( vmin, _mm_max_ss( _mm_shuffle_ps( vmin, vmin, _MM_SHUFFLE( 1, 1, 1, 1 ) ), _mm_movehl_ps( vmin, vmin ) ) );
+	const __m128 tmax = _mm_min_ss( vmax, _mm_min_ss( _mm_shuffle_ps( vmax, vmax, _MM_SHUFFLE( 1, 1, 1, 1 ) ), _mm_movehl_ps( vmax, vmax ) ) );
+
+	const float tnear = _mm_cvtss_f32( tmin );
+	const float tfar = _mm_cvtss_f32( tmax );
+	return ( tfar >= tnear && tfar > 0.f ) ? tnear : FLT_MAX;
+}
+
+// Compact node, 32 bytes so that two nodes share a cache line.
+// Bounds are stored in the first three lanes, the fourth lane is reused for the links.
+struct ALIGN( 32 ) BVHNode
+{
+	union {
+		__m128 bmin4;
+		struct
+		{
+			float bmin[3];
+			uint leftFirst; // interior: index of the right child, leaf: first entry in the primitive index array
+		};
+	};
+	union {
+		__m128 bmax4;
+		struct
+		{
+			float bmax[3];
+			uint count : 30; // number of primitives, 0 for interior nodes
+			uint axis : 2;   // split axis of interior nodes
+		};
+	};
+
+	// Interior nodes always store their left child directly after themselves
+	__inline bool isLeaf() const { return count > 0; }
+	__inline uint left( uint self ) const { return self + 1; }
+	__inline uint right() const { return leftFirst; }
+};
+
+class BVH
+{
+  public:
+	BVH( vector<Primitive *> primitives ) : primitives( primitives ), nodes( nullptr ), primIndices( nullptr ), nodeCount( 0 ), ownsArrays( true )
+	{
+		constructBVH();
+	}
 
-	BVHNode( vector<Primitive *> primitives ) : primitives( primitives )
+	// Adopts a finished tree over primitives, from a SceneCache for example. The arrays are used in place and have to outlive the BVH
+	BVH( vector<Primitive *> primitives, const BVHNode *nodes, uint nodeCount, const uint *primIndices ) : primitives( primitives ), nodes( const_cast<BVHNode *>( nodes ) ), primIndices( const_cast<uint *>( primIndices ) ), nodeCount( nodeCount ), ownsArrays( false )
 	{
-		bounds = aabb();
-		bounds.Reset();
-		isLeaf = true;
-		left = nullptr;
-		right = nullptr;
+	}
+
+	BVH( const BVH & ) = delete;
+	BVH &operator=( const BVH & ) = delete;
 
-		for ( size_t i = 0; i < primitives.size(); i++ )
+	~BVH()
+	{
+		if ( !ownsArrays )
 		{
-			bounds.Grow( primitives[i]->volume() );
+			return;
 		}
+
+		FREE64( nodes );
+		nodes = nullptr;
+
+		delete[] primIndices;
+		primIndices = nullptr;
 	}
 
-	void subdivide( int currentDepth )
+	void constructBVH()
 	{
-		// Conditions warrant a leaf node
-		if ( ( primitives.size() < 3 ) || ( currentDepth >= BVHDEPTH ) )
+		const uint count = primitives.size();
+		primIndices = new uint[max( 1u, count )];
+
+		if ( count == 0 )
 		{
+			// MALLOC64 expects a multiple of the alignment
+			nodes = (BVHNode *)MALLOC64( 2 * sizeof( BVHNode ) );
 			return;
 		}
 
-		// http://raytracey.blogspot.com/2016/01/ , Tutorial
-		// https://github.com/straaljager/GPU-path-tracing-tutorial-3/ , Code
+		// Gather bounds and centroids once, the builder only touches these arrays
+		primBounds.resize( count );
+		centroids.resize( count );
 
-#ifdef USE_SAH
-		int bestAxis = -1;
-		float bestSplit = FLT_MAX;
-		vector<Primitive *> leftPrims, rightPrims;
-		this->calculateSAH( bestAxis, bestSplit, leftPrims, rightPrims ); // currently bestAxis, bestSplit not used
-#else
-		// Split aabb on longest axis
-		int longestAxis = bounds.LongestAxis();
-		float center = bounds.Center( longestAxis );
+#pragma omp parallel for
+		for ( int i = 0; i < (int)count; i++ )
+		{
+			primIndices[i] = i;
+			primBounds[i] = primitives[i]->volume();
+			centroids[i] = primitives[i]->origin;
+		}
 
-		// Divide primitives across left and right nodes
-		vector<Primitive *> leftPrims;
-		vector<Primitive *> rightPrims;
+		aabb rootBounds, centroidBounds;
+		rootBounds.Reset();
+		centroidBounds.Reset();
 
-		for ( Primitive *p : primitives )
+		for ( uint i = 0; i < count; i++ )
 		{
-			if ( p->origin[longestAxis] < center )
-			{
-				leftPrims.push_back( p );
-			}
-			else
-			{
-				rightPrims.push_back( p );
-			}
+			rootBounds.Grow( primBounds[i] );
+			centroidBounds.Grow( centroids[i] );
+		}
+
+		// The top levels are built here, with the binning spread over all threads.
+		// A binary tree with at most one primitive per leaf never needs more than 2N - 1 nodes.
+		BVHNode *top = (BVHNode *)MALLOC64( max( 2u, count * 2 ) * sizeof( BVHNode ) );
+		BVHNode &root = top[0];
+		root.bmin4 = rootBounds.bmin4;
+		root.bmax4 = rootBounds.bmax4;
+		root.leftFirst = 0;
+		root.count = count;
+		uint topCount = 1;
+
+		vector<BuildTask> tasks;
+		subdivide( top, topCount, 0, centroidBounds, 0, &tasks );
+
+		// Subtrees below BVH_TASK_THRESHOLD are built independently, each thread appending to its own arena.
+		// The largest subtrees go first, so no thread is left with a big one at the end.
+		sort( tasks.begin(), tasks.end(), [&top]( const BuildTask &a, const BuildTask &b ) { return top[a.node].count > top[b.node].count; } );
+		vector<vector<BVHNode>> arenas( omp_get_max_threads() );
+		for ( vector<BVHNode> &arena : arenas )
+		{
+			arena.reserve( 2 * count / arenas.size() );
 		}
-#endif // USE_SAH
 
-		left = new BVHNode( leftPrims );
-		left->subdivide( currentDepth + 1 );
+#pragma omp parallel for schedule( dynamic, 1 )
+		for ( int i = 0; i < (int)tasks.size(); i++ )
+		{
+			BuildTask &task = tasks[i];
+			task.arena = omp_get_thread_num();
+			vector<BVHNode> &arena = arenas[task.arena];
 
-		right = new BVHNode( rightPrims );
-		right->subdivide( currentDepth + 1 );
+			// Reserve the worst case up front, the pool may not move while the subtree is built
+			const uint subtreeCount = top[task.node].count;
+			task.offset = arena.size();
+			arena.resize( task.offset + max( 1u, subtreeCount * 2 - 1 ) );
 
-		// We are no longer a leaf
-		isLeaf = false;
-		primitives.clear();
+			BVHNode *pool = &arena[task.offset];
+			pool[0] = top[task.node];
+			task.size = 1;
+			subdivide( pool, task.size, 0, task.centroidBounds, task.depth, nullptr );
+
+			arena.resize( task.offset + task.size );
+		}
+
+		// Stitch the top levels and the subtrees together into one depth-first array
+		vector<int> taskOf( topCount, -1 );
+		uint totalCount = topCount;
+		for ( uint i = 0; i < tasks.size(); i++ )
+		{
+			taskOf[tasks[i].node] = i;
+			totalCount += tasks[i].size - 1;
+		}
+
+		// MALLOC64 expects a multiple of the alignment
+		nodes = (BVHNode *)MALLOC64( ( ( totalCount + 1 ) & ~1u ) * sizeof( BVHNode ) );
+		nodeCount = 0;
+		linearize( top, 0, taskOf, tasks, arenas );
+
+		FREE64( top );
+
+		// Only needed during construction
+		vector<aabb>().swap( primBounds );
+		vector<vec3>().swap( centroids );
 	}
 
-	Hit intersect( const Ray &r ) const
+	// Closest hit only, Primitive::getHit turns it into a shading record
+	Intersection intersect( const Ray &r ) const
 	{
-		if ( isLeaf )
+		Intersection closestHit;
+
+		if ( primitives.empty() || rayIntersectsBounds( nodes[0].bmin4, nodes[0].bmax4, r ) == FLT_MAX )
 		{
-			// Find closest hit in this leaf
-			Hit h = Hit();
-			h.hitType = 0;
-			h.t = FLT_MAX;
+			return closestHit;
+		}
+
+		// Every level pushes at most one node, so the depth limit bounds the stack
+		StackEntry stack[BVHDEPTH];
+		uint stackPtr = 0;
+		uint idx = 0;
+		TraversalCounter counter;
 
-			for ( Primitive *p : primitives )
+		while ( true )
+		{
+			const BVHNode &node = nodes[idx];
+			counter.nodes++;
+
+			if ( node.isLeaf() )
 			{
-				Hit tmp = p->hit( r );
-				if ( tmp.t < h.t )
+				counter.tests += node.count;
+				for ( uint i = 0; i < node.count; i++ )
 				{
-					h = tmp;
+					const uint primId = primIndices[node.leftFirst + i];
+					if ( primitives[primId]->intersect( r, closestHit ) )
+					{
+						closestHit.primId = primId;
+					}
 				}
 			}
-			return h;
-		}
-		else
-		{
-			// Determine if we get hits in the child nodes
-			// Also determine which hit, if left and right hits exist, is closest
-			Hit leftHit = Hit(), rightHit = Hit();
-			leftHit.hitType = 0;
-			rightHit.hitType = 0;
+			else
+			{
+				// The left child holds the lower half along the split axis, visit it first when moving in the positive direction
+				uint nearIdx = node.left( idx );
+				uint farIdx = node.right();
+				if ( r.sign[node.axis] )
+				{
+					swap( nearIdx, farIdx );
+				}
+
+				// Misses return FLT_MAX, so this also culls nodes beyond the closest hit
+				const float tnearNear = rayIntersectsBounds( nodes[nearIdx].bmin4, nodes[nearIdx].bmax4, r );
+				const float tnearFar = rayIntersectsBounds( nodes[farIdx].bmin4, nodes[farIdx].bmax4, r );
+				const bool hitNear = tnearNear < closestHit.t;
+				const bool hitFar = tnearFar < closestHit.t;
 
-			if ( rayIntersectsBounds( left->bounds, r ) )
+				if ( hitNear )
+				{
+					if ( hitFar )
+					{
+						stack[stackPtr++] = {farIdx, tnearFar};
+					}
+					idx = nearIdx;
+					continue;
+				}
+				else if ( hitFar )
+				{
+					idx = farIdx;
+					continue;
+				}
+			}
+
+			// Pop the next node that can still contain a closer hit
+			bool found = false;
+			while ( stackPtr > 0 )
 			{
-				leftHit = left->intersect( r );
+				const StackEntry &entry = stack[--stackPtr];
+				if ( entry.tnear < closestHit.t )
+				{
+					idx = entry.idx;
+					found = true;
+					break;
+				}
 			}
 
-			if ( rayIntersectsBounds( right->bounds, r ) )
+			if ( !found )
 			{
-				rightHit = right->intersect( r );
+				return closestHit;
 			}
+		}
+	}
 
-			// Both return a hit
-			if ( rightHit.hitType != 0 && leftHit.hitType != 0 )
+	// Closest hits of a whole packet, isects holds one entry per ray.
+	// Nodes are fetched and culled once for all rays, incoherent packets fall back to tracing each ray on its own.
+	void intersect( const RayPacket &packet, Intersection *isects ) const
+	{
+		const int rayCount = PACKETSIZE * PACKETSIZE;
+
+		if ( !packet.coherent )
+		{
+			for ( int i = 0; i < rayCount; i++ )
 			{
-				// Assumed is that neither hits are on the same t
-				if ( rightHit.t < leftHit.t )
+				isects[i] = intersect( packet.rays[i] );
+			}
+			return;
+		}
+
+		for ( int i = 0; i < rayCount; i++ )
+		{
+			isects[i] = Intersection();
+		}
+
+		if ( primitives.empty() || packetIntersectsBounds( nodes[0].bmin4, nodes[0].bmax4, packet ) == FLT_MAX )
+		{
+			return;
+		}
+
+		// Furthest closest hit in the packet, nodes beyond it cannot improve any ray
+		float packetT = FLT_MAX;
+
+		// Rays before first miss the node, and with it everything below it
+		PacketEntry stack[BVHDEPTH];
+		uint stackPtr = 0;
+		uint idx = 0;
+		int first = 0;
+		TraversalCounter counter;
+
+		while ( true )
+		{
+			const BVHNode &node = nodes[idx];
+			first = firstActiveRay( node, packet, isects, first );
+			counter.nodes++;
+
+			if ( first == rayCount )
+			{
+				// No ray actually hits the node, the interval test was too conservative
+			}
+			else if ( node.isLeaf() )
+			{
+				for ( int j = first; j < rayCount; j++ )
 				{
-					return rightHit;
+					const Ray &r = packet.rays[j];
+					Intersection &isect = isects[j];
+
+					if ( rayIntersectsBounds( node.bmin4, node.bmax4, r ) < isect.t )
+					{
+						counter.tests += node.count;
+						for ( uint i = 0; i < node.count; i++ )
+						{
+							const uint primId = primIndices[node.leftFirst + i];
+							if ( primitives[primId]->intersect( r, isect ) )
+							{
+								isect.primId = primId;
+							}
+						}
+					}
 				}
-				else
+
+				packetT = 0.f;
+				for ( int j = 0; j < rayCount; j++ )
 				{
-					return leftHit;
+					packetT = max( packetT, isects[j].t );
 				}
 			}
-			// Only left
-			else if ( rightHit.hitType == 0 && leftHit.hitType != 0 )
+			else
 			{
-				return leftHit;
+				// All rays share the direction signs, so they agree on the near child
+				uint nearIdx = node.left( idx );
+				uint farIdx = node.right();
+				if ( packet.rays[0].sign[node.axis] )
+				{
+					swap( nearIdx, farIdx );
+				}
+
+				const float tnearNear = packetIntersectsBounds( nodes[nearIdx].bmin4, nodes[nearIdx].bmax4, packet );
+				const float tnearFar = packetIntersectsBounds( nodes[farIdx].bmin4, nodes[farIdx].bmax4, packet );
+				const bool hitNear = tnearNear < packetT;
+				const bool hitFar = tnearFar < packetT;
+
+				if ( hitNear )
+				{
+					if ( hitFar )
+					{
+						stack[stackPtr++] = {farIdx, first, tnearFar};
+					}
+					idx = nearIdx;
+					continue;
+				}
+				else if ( hitFar )
+				{
+					idx = farIdx;
+					continue;
+				}
 			}
-			// Only right
-			else if ( rightHit.hitType != 0 && leftHit.hitType == 0 )
+
+			bool found = false;
+			while ( stackPtr > 0 )
 			{
-				return rightHit;
+				const PacketEntry &entry = stack[--stackPtr];
+				if ( entry.tnear < packetT )
+				{
+					idx = entry.idx;
+					first = entry.first;
+					found = true;
+					break;
+				}
 			}
-			// Neither
-			else
+
+			if ( !found )
 			{
-				// leftHit should still have hitType 0, this is fine
-				return leftHit;
+				return;
 			}
 		}
 	}
 
-	// Debug BVH visualizer
-	vec3 debug( const Ray &r ) const
+	// Any hit closer than tmax, stops at the first one and never builds shading data
+	bool occluded( const Ray &r, float tmax ) const
 	{
-		if ( rayIntersectsBounds( bounds, r ) )
+		if ( primitives.empty() || rayIntersectsBounds( nodes[0].bmin4, nodes[0].bmax4, r ) >= tmax )
 		{
+			return false;
+		}
 
-			if ( isLeaf )
+		uint stack[BVHDEPTH];
+		uint stackPtr = 0;
+		uint idx = 0;
+		TraversalCounter counter;
+
+		while ( true )
+		{
+			const BVHNode &node = nodes[idx];
+			counter.nodes++;
+
+			if ( node.isLeaf() )
 			{
-				return vec3( 0.f, 1.f / (float)BVHDEPTH, 0.f );
+				for ( uint i = 0; i < node.count; i++ )
+				{
+					// Primitives only report hits closer than isect.t
+					counter.tests++;
+					Intersection isect;
+					isect.t = tmax;
+					if ( primitives[primIndices[node.leftFirst + i]]->intersect( r, isect ) )
+					{
+						return true;
+					}
+				}
 			}
 			else
 			{
-				return vec3( 0.f, 1.f / (float)BVHDEPTH, 0.f ) + left->debug( r ) + right->debug( r );
+				// Order does not matter for correctness, but the near child is more likely to block the ray
+				uint nearIdx = node.left( idx );
+				uint farIdx = node.right();
+				if ( r.sign[node.axis] )
+				{
+					swap( nearIdx, farIdx );
+				}
+
+				const bool hitNear = rayIntersectsBounds( nodes[nearIdx].bmin4, nodes[nearIdx].bmax4, r ) < tmax;
+				const bool hitFar = rayIntersectsBounds( nodes[farIdx].bmin4, nodes[farIdx].bmax4, r ) < tmax;
+
+				if ( hitNear )
+				{
+					if ( hitFar )
+					{
+						stack[stackPtr++] = farIdx;
+					}
+					idx = nearIdx;
+					continue;
+				}
+				else if ( hitFar )
+				{
+					idx = farIdx;
+					continue;
+				}
+			}
+
+			if ( stackPtr == 0 )
+			{
+				return false;
 			}
+			idx = stack[--stackPtr];
 		}
-		else
+	}
+
+	// Debug BVH visualizer
+	vec3 debug( const Ray &r ) const
+	{
+		if ( primitives.empty() )
 		{
 			return vec3();
 		}
+		return debug( 0, r );
 	}
 
+	// Read access for structures derived from the binary tree, such as MBVH
+	const BVHNode *getNodes() const { return nodes; }
+	uint getNodeCount() const { return nodeCount; }
+	const uint *getPrimIndices() const { return primIndices; }
+	const vector<Primitive *> &getPrimitives() const { return primitives; }
+
   private:
-	// Based on Slab method, as described on https://tavianator.com/fast-branchless-raybounding-box-intersections/
-	inline bool rayIntersectsBounds( const aabb &bounds, const Ray &r ) const
-	{
-#if 0
-		__m128 tmin4 = _mm_setr_ps( -FLT_MAX, -FLT_MAX, -FLT_MAX, 0 );
-		__m128 tmax4 = _mm_setr_ps( FLT_MAX, FLT_MAX, FLT_MAX, 0 );
+	vector<Primitive *> primitives;
 
-		__m128 rayOri = _mm_setr_ps( r.origin[0], r.origin[0], r.origin[0], 0.f );
-		__m128 rayDir = _mm_setr_ps( r.direction[0], r.direction[0], r.direction[0], 0.f );
+	BVHNode *nodes;
+	uint *primIndices;
+	uint nodeCount;
+	bool ownsArrays; // an adopted tree is never written, nor freed
 
-		__m128 t1_4 = _mm_div_ps( _mm_sub_ps( bounds.bmin4, rayOri ), rayDir );
-		__m128 t2_4 = _mm_div_ps( _mm_sub_ps( bounds.bmax4, rayOri ), rayDir );
+	// Build data, released after construction
+	vector<aabb> primBounds;
+	vector<vec3> centroids;
 
-		__m128 le_mask = _mm_cmpnle_ps( rayOri, bounds.bmin4 );
-		__m128 ge_mask = _mm_cmpnge_ps( rayOri, bounds.bmax4 );
+	struct Bin
+	{
+		aabb bounds;
+		uint count;
+	};
 
-		tmin4 = _mm_max_ps( tmin4, _mm_min_ps( t1_4, t2_4 ) );
-		tmax4 = _mm_min_ps( tmax4, _mm_max_ps( t1_4, t2_4 ) );
+	struct BuildTask
+	{
+		uint node; // top-level node that becomes the root of the subtree
+		aabb centroidBounds;
+		int depth;
 
-		// TODO: Figure out how to check if masks contain a true value
-		// TODO: Figure out how to check last condition
+		// Location of the finished subtree, node links inside it are relative to its root
+		int arena;
+		uint offset, size;
+	};
 
-#else
-		float tmin = -FLT_MAX, tmax = FLT_MAX;
+	struct PacketEntry
+	{
+		uint idx;
+		int first; // first ray of the packet that hits the parent
+		float tnear;
+	};
 
-		for ( int i = 0; i < 3; ++i )
+	// Index of the first ray from start onwards that hits the node before its closest hit, or the packet size if none does
+	static int firstActiveRay( const BVHNode &node, const RayPacket &packet, const Intersection *isects, int start )
+	{
+		for ( int j = start; j < PACKETSIZE * PACKETSIZE; j++ )
 		{
-			if ( r.direction[i] != 0.0 )
+			if ( rayIntersectsBounds( node.bmin4, node.bmax4, packet.rays[j] ) < isects[j].t )
 			{
-				// Optimization opportunity: precalculate inverse of directions
-				float t1 = ( bounds.bmin[i] - r.origin[i] ) / r.direction[i];
-				float t2 = ( bounds.bmax[i] - r.origin[i] ) / r.direction[i];
+				return j;
+			}
+		}
+		return PACKETSIZE * PACKETSIZE;
+	}
 
-				tmin = max( tmin, min( t1, t2 ) );
-				tmax = min( tmax, max( t1, t2 ) );
+	struct StackEntry
+	{
+		uint idx;
+		float tnear; // entry distance of the node's bounds
+	};
+
+	// Copies the top levels depth-first, splicing in the subtrees where tasks were spawned
+	void linearize( const BVHNode *top, uint topIdx, const vector<int> &taskOf, const vector<BuildTask> &tasks, const vector<vector<BVHNode>> &arenas )
+	{
+		if ( taskOf[topIdx] >= 0 )
+		{
+			const BuildTask &task = tasks[taskOf[topIdx]];
+			const BVHNode *subtree = &arenas[task.arena][task.offset];
+			const uint base = nodeCount;
+
+			for ( uint i = 0; i < task.size; i++ )
+			{
+				BVHNode &node = nodes[nodeCount++];
+				node = subtree[i];
+				if ( !node.isLeaf() )
+				{
+					node.leftFirst += base;
+				}
 			}
-			else if ( r.origin[i] <= bounds.bmin[i] || r.origin[i] >= bounds.bmax[i] )
+			return;
+		}
+
+		const BVHNode &topNode = top[topIdx];
+		const uint idx = nodeCount++;
+		nodes[idx] = topNode;
+
+		if ( !topNode.isLeaf() )
+		{
+			linearize( top, topNode.left( topIdx ), taskOf, tasks, arenas );
+			nodes[idx].leftFirst = nodeCount;
+			linearize( top, topNode.right(), taskOf, tasks, arenas );
+		}
+	}
+
+	// Maps a centroid to its bin along an axis, identical for binning and partitioning
+	__inline int binIndex( const vec3 &centroid, int axis, const aabb &centroidBounds, float scale ) const
+	{
+		return min( BINCOUNT - 1, (int)( ( centroid[axis] - centroidBounds.bmin[axis] ) * scale ) );
+	}
+
+	// Fills the bins of all three axes in a single pass
+	void binPrimitives( uint first, uint count, const aabb &centroidBounds, const float *scale, Bin ( &bins )[3][BINCOUNT] ) const
+	{
+		for ( int axis = 0; axis < 3; axis++ )
+		{
+			for ( int b = 0; b < BINCOUNT; b++ )
 			{
-				return false;
+				bins[axis][b].bounds.Reset();
+				bins[axis][b].count = 0;
 			}
 		}
 
-		return tmax > tmin && tmax > 0.0;
-#endif
+		for ( uint i = first; i < first + count; i++ )
+		{
+			const uint prim = primIndices[i];
+
+			for ( int axis = 0; axis < 3; axis++ )
+			{
+				Bin &bin = bins[axis][binIndex( centroids[prim], axis, centroidBounds, scale[axis] )];
+				bin.bounds.Grow( primBounds[prim] );
+				bin.count++;
+			}
+		}
 	}
 
-	void calculateSAH( int &bestAxis, float &bestSplit, vector<Primitive *> &bestLeftPrims, vector<Primitive *> &bestRightPrims )
+	// Same as binPrimitives, but every thread bins a part of the range before the bins are merged.
+	// Only pays off for the large nodes at the top of the tree.
+	void binPrimitivesParallel( uint first, uint count, const aabb &centroidBounds, const float *scale, Bin ( &bins )[3][BINCOUNT] ) const
 	{
-		float side1 = bounds.Extend( 0 );
-		float side2 = bounds.Extend( 1 );
-		float side3 = bounds.Extend( 2 );
-
-		// Calculate the cost of the head
-		float splitCost = FLT_MAX;
-		float minCost = primitives.size() * ( side1 * side2 + side2 * side3 + side3 * side1 );
-		float split;
-		float surfaceLeft, surfaceRight;
-		BVHNode *temp_left, *temp_right;
-		vector<Primitive *> primsLeft, primsRight;
-
-		// Loop over the three axis
 		for ( int axis = 0; axis < 3; axis++ )
 		{
-			// Loop over all possible splits (primitive centroids)
-			for ( int bin = 1; bin < BINCOUNT; bin++ )
+			for ( int b = 0; b < BINCOUNT; b++ )
 			{
-				split = bounds.bmin[axis] + bounds.Extend( axis ) * bin / BINCOUNT;
-				primsLeft.clear();
-				primsRight.clear();
+				bins[axis][b].bounds.Reset();
+				bins[axis][b].count = 0;
+			}
+		}
+
+		const int threadCount = omp_get_max_threads();
+		const uint chunk = ( count + threadCount - 1 ) / threadCount;
+
+#pragma omp parallel for
+		for ( int t = 0; t < threadCount; t++ )
+		{
+			const uint chunkFirst = first + min( count, t * chunk );
+			const uint chunkCount = min( count, ( t + 1 ) * chunk ) - min( count, t * chunk );
 
-				// Count number of primitives in left and right nodes
-				for ( Primitive *prim : primitives )
+			Bin localBins[3][BINCOUNT];
+			binPrimitives( chunkFirst, chunkCount, centroidBounds, scale, localBins );
+
+#pragma omp critical
+			for ( int axis = 0; axis < 3; axis++ )
+			{
+				for ( int b = 0; b < BINCOUNT; b++ )
 				{
-					if ( prim->origin[axis] <= split )
-					{
-						primsLeft.push_back( prim );
-					}
-					else
-					{
-						primsRight.push_back( prim );
-					}
+					bins[axis][b].bounds.Grow( localBins[axis][b].bounds );
+					bins[axis][b].count += localBins[axis][b].count;
 				}
+			}
+		}
+	}
+
+	// Binned SAH, based on "On fast Construction of SAH-based Bounding Volume Hierarchies" by Ingo Wald.
+	// Children are written directly into the pool, depth-first, so the left child always follows its parent.
+	// While tasks is set, subtrees below BVH_TASK_THRESHOLD are left as leaves and queued instead.
+	void subdivide( BVHNode *pool, uint &poolCount, uint idx, const aabb &centroidBounds, int currentDepth, vector<BuildTask> *tasks )
+	{
+		BVHNode &node = pool[idx];
+		const uint first = node.leftFirst;
+		const uint count = node.count;
+
+		// Conditions warrant a leaf node
+		if ( ( count < 3 ) || ( currentDepth >= BVHDEPTH ) )
+		{
+			return;
+		}
+
+		if ( tasks && count <= BVH_TASK_THRESHOLD )
+		{
+			BuildTask task;
+			task.node = idx;
+			task.centroidBounds = centroidBounds;
+			task.depth = currentDepth;
+			tasks->push_back( task );
+			return;
+		}
+
+		Bin bins[3][BINCOUNT];
+		float scale[3];
 
-				int countLeft = primsLeft.size();
-				int countRight = primsRight.size();
+		for ( int axis = 0; axis < 3; axis++ )
+		{
+			const float extend = centroidBounds.Extend( axis );
+			scale[axis] = extend > 0.f ? BINCOUNT / extend : 0.f;
+		}
 
-				// Avoid useless partionings - need to check
-				// if ( countLeft <= 1 || countRight <= 1 ) continue;
+		if ( count > BVH_TASK_THRESHOLD )
+		{
+			binPrimitivesParallel( first, count, centroidBounds, scale, bins );
+		}
+		else
+		{
+			binPrimitives( first, count, centroidBounds, scale, bins );
+		}
 
-				// Update children
-				temp_left = new BVHNode( primsLeft );
-				temp_right = new BVHNode( primsRight );
+		int bestAxis = -1;
+		int bestSplit = 0; // first bin on the right side
+		float bestCost = FLT_MAX;
+		aabb bestLeft, bestRight;
 
-				// Calculate sides of the left and right bounding boxes
-				float lside1 = temp_left->bounds.Extend( 0 );
-				float lside2 = temp_left->bounds.Extend( 1 );
-				float lside3 = temp_left->bounds.Extend( 2 );
+		for ( int axis = 0; axis < 3; axis++ )
+		{
+			// Sweep from the left, storing the area and count left of each split plane
+			float leftArea[BINCOUNT - 1];
+			uint leftCount[BINCOUNT - 1];
+			aabb leftBounds[BINCOUNT - 1];
+			aabb bounds;
+			bounds.Reset();
+			uint sum = 0;
+
+			for ( int b = 0; b < BINCOUNT - 1; b++ )
+			{
+				bounds.Grow( bins[axis][b].bounds );
+				sum += bins[axis][b].count;
+				leftBounds[b] = bounds;
+				leftArea[b] = bounds.Area();
+				leftCount[b] = sum;
+			}
 
-				float rside1 = temp_right->bounds.Extend( 0 );
-				float rside2 = temp_right->bounds.Extend( 1 );
-				float rside3 = temp_right->bounds.Extend( 2 );
+			// Sweep from the right, evaluating the cost of each split plane on the way
+			bounds.Reset();
+			sum = 0;
 
-				// Deallocate memory
-				delete temp_left, temp_right;
-				temp_left = nullptr;
-				temp_right = nullptr;
+			for ( int b = BINCOUNT - 1; b > 0; b-- )
+			{
+				bounds.Grow( bins[axis][b].bounds );
+				sum += bins[axis][b].count;
 
-				// Calculate surface area of left and right boxes
-				float surfaceLeft = lside1 * lside2 + lside2 * lside3 + lside3 * lside1;
-				float surfaceRight = rside1 * rside2 + rside2 * rside3 + rside3 * rside1;
+				// Splitting off nothing does not help
+				if ( sum == 0 || leftCount[b - 1] == 0 )
+				{
+					continue;
+				}
 
-				// Calculate cost of split
-				splitCost = surfaceLeft * countLeft + surfaceRight * countRight;
+#ifdef USE_SAH
+				const float cost = leftArea[b - 1] * leftCount[b - 1] + bounds.Area() * sum;
+#else
+				// Without SAH, split through the middle of the longest centroid axis
+				const float cost = ( axis == centroidBounds.LongestAxis() && b == BINCOUNT / 2 ) ? 0.f : FLT_MAX;
+#endif
 
-				// Is this split better than the current minimum?
-				if ( splitCost < minCost )
+				if ( cost < bestCost )
 				{
-					minCost = splitCost;
-					bestSplit = split;
+					bestCost = cost;
 					bestAxis = axis;
-					bestLeftPrims.clear();
-					bestLeftPrims = primsLeft;
-					bestRightPrims.clear();
-					bestRightPrims = primsRight;
+					bestSplit = b;
+					bestLeft = leftBounds[b - 1];
+					bestRight = bounds;
 				}
 			}
 		}
-	}
-};
 
-class BVH
-{
-  public:
-	BVH( vector<Primitive *> primitives )
-	{
-		constructBVH( primitives );
-	}
+#ifdef USE_SAH
+		// Only split when the children are expected to be cheaper than intersecting everything in this node
+		aabb nodeBounds( node.bmin4, node.bmax4 );
+		if ( bestAxis == -1 || bestCost >= nodeBounds.Area() * count )
+		{
+			return;
+		}
+#else
+		if ( bestAxis == -1 )
+		{
+			return;
+		}
+#endif
 
-	void constructBVH( vector<Primitive *> primitives )
-	{
-		head = new BVHNode( primitives );
-		head->subdivide( 0 );
-	}
+		// Partition the primitive indices in place, gathering the centroid bounds of both sides
+		aabb leftCentroids, rightCentroids;
+		leftCentroids.Reset();
+		rightCentroids.Reset();
 
-	Hit intersect( const Ray &r ) const
-	{
-		return head->intersect( r );
+		uint i = first;
+		uint j = first + count;
+
+		while ( i < j )
+		{
+			const vec3 &centroid = centroids[primIndices[i]];
+
+			if ( binIndex( centroid, bestAxis, centroidBounds, scale[bestAxis] ) < bestSplit )
+			{
+				leftCentroids.Grow( centroid );
+				i++;
+			}
+			else
+			{
+				rightCentroids.Grow( centroid );
+				swap( primIndices[i], primIndices[--j] );
+			}
+		}
+
+		const uint leftCount = i - first;
+
+		const uint leftIdx = poolCount++;
+		BVHNode &left = pool[leftIdx];
+		left.bmin4 = bestLeft.bmin4;
+		left.bmax4 = bestLeft.bmax4;
+		left.leftFirst = first;
+		left.count = leftCount;
+		subdivide( pool, poolCount, leftIdx, leftCentroids, currentDepth + 1, tasks );
+
+		const uint rightIdx = poolCount++;
+		BVHNode &right = pool[rightIdx];
+		right.bmin4 = bestRight.bmin4;
+		right.bmax4 = bestRight.bmax4;
+		right.leftFirst = first + leftCount;
+		right.count = count - leftCount;
+		subdivide( pool, poolCount, rightIdx, rightCentroids, currentDepth + 1, tasks );
+
+		// We are no longer a leaf
+		node.leftFirst = rightIdx;
+		node.count = 0;
+		node.axis = bestAxis;
 	}
 
-	vec3 debug( const Ray &r ) const
+	vec3 debug( uint idx, const Ray &r ) const
 	{
-		return head->debug( r );
-	}
+		const BVHNode &node = nodes[idx];
 
-  private:
-	BVHNode *head;
-};
\ No newline at end of file
+		if ( rayIntersectsBounds( node.bmin4, node.bmax4, r ) != FLT_MAX )
+		{
+			if ( node.isLeaf() )
+			{
+				return vec3( 0.f, 1.f / (float)BVHDEPTH, 0.f );
+			}
+			else
+			{
+				return vec3( 0.f, 1.f / (float)BVHDEPTH, 0.f ) + debug( node.left( idx ), r ) + debug( node.right(), r );
+			}
+		}
+		else
+		{
+			return vec3();
+		}
+	}
+};
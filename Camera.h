@@ -29,23 +29,21 @@ class Camera
 		width = height * aspect;
 	}
 
-	Ray getRay( unsigned x, unsigned y ) const
+	// For pixel ( x, y ) of a width x height image, with square pixels.
+	// u holds four uniform numbers in [0, 1): two pick the point on the lens, two the point inside the pixel
+	Ray getRay( unsigned x, unsigned y, unsigned width, unsigned height, const float *u ) const
 	{
-		Ray r;
-
 		// Randomize origin for DoF
-		vec3 randVec = rotateVec( up, forward, Rand( 2 * PI ) );
-		r.origin = origin + randVec * Rand( aperture );
+		vec3 randVec = rotateVec( up, forward, u[0] * 2 * PI );
+		vec3 rayOrigin = origin + randVec * ( u[1] * aperture );
 
 		// Add some AA
-		float norm_x = ( ( float( x ) + ( -1.f + Rand( 1.f ) ) ) / float( SCRWIDTH ) ) - 0.5f;
-		float norm_y = ( ( float( y ) + ( -1.f + Rand( 1.f ) ) ) / float( SCRHEIGHT ) ) - 0.5f;
+		float norm_x = ( ( float( x ) + ( -1.f + u[2] ) ) / float( width ) ) - 0.5f;
+		float norm_y = ( ( float( y ) + ( -1.f + u[3] ) ) - 0.5f * float( height ) ) / float( width );
 
 		vec3 imagePoint = norm_x * right * ( focusDistance * 0.5f ) * ( 1 / focalLength ) + norm_y * up * ( focusDistance * 0.5f ) * ( 1 / focalLength ) + origin + forward * focusDistance;
 
-		r.direction = imagePoint - r.origin;
-
-		return r;
+		return Ray( rayOrigin, imagePoint - rayOrigin );
 	}
 
 	// Relative zoom is true when you simply want to zoom in or out
@@ -90,11 +88,7 @@ class Camera
 
 	Ray focusRay()
 	{
-		Ray r;
-		r.origin = origin;
-		r.direction = forward;
-
-		return r;
+		return Ray( origin, forward );
 	}
 
 	// Own code
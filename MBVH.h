@@ -0,0 +1,614 @@
+#pragma once
+
+// Marks a child slot or triangle lane that is not in use
+#define MBVH_EMPTY 0xFFFFFFFFu
+
+// Width-agnostic wrappers, so the kernels below and the frame resolve in the renderer are written once for SSE and AVX
+#if MBVH_WIDTH == 8
+typedef __m256 mfloat;
+#define mload( p ) _mm256_load_ps( p )
+#define mstore( p, a ) _mm256_store_ps( p, a )
+#define mset1( a ) _mm256_set1_ps( a )
+#define madd( a, b ) _mm256_add_ps( a, b )
+#define msub( a, b ) _mm256_sub_ps( a, b )
+#define mmul( a, b ) _mm256_mul_ps( a, b )
+#define mdiv( a, b ) _mm256_div_ps( a, b )
+#define mmin( a, b ) _mm256_min_ps( a, b )
+#define mmax( a, b ) _mm256_max_ps( a, b )
+#define mand( a, b ) _mm256_and_ps( a, b )
+#define mandnot( a, b ) _mm256_andnot_ps( a, b )
+#define mcmplt( a, b ) _mm256_cmp_ps( a, b, _CMP_LT_OQ )
+#define mcmple( a, b ) _mm256_cmp_ps( a, b, _CMP_LE_OQ )
+#define mcmpgt( a, b ) _mm256_cmp_ps( a, b, _CMP_GT_OQ )
+#define mcmpge( a, b ) _mm256_cmp_ps( a, b, _CMP_GE_OQ )
+#define mmask( a ) _mm256_movemask_ps( a )
+#define mloadu( p ) _mm256_loadu_ps( p )
+#define msqrt( a ) _mm256_sqrt_ps( a )
+typedef __m256i mint;
+#define mtoint( a ) _mm256_cvttps_epi32( a )
+#define mset1i( a ) _mm256_set1_epi32( a )
+#define mori( a, b ) _mm256_or_si256( a, b )
+#define mslli( a, n ) _mm256_slli_epi32( a, n )
+#define mstoreui( p, a ) _mm256_storeu_si256( (__m256i *)( p ), a )
+#define mloadi( p ) _mm256_load_si256( (const __m256i *)( p ) )
+#define maddi( a, b ) _mm256_add_epi32( a, b )
+#define mxori( a, b ) _mm256_xor_si256( a, b )
+#define msrli( a, n ) _mm256_srli_epi32( a, n )
+#define mtofloat( a ) _mm256_cvtepi32_ps( a )
+#else
+typedef __m128 mfloat;
+#define mload( p ) _mm_load_ps( p )
+#define mstore( p, a ) _mm_store_ps( p, a )
+#define mset1( a ) _mm_set1_ps( a )
+#define madd( a, b ) _mm_add_ps( a, b )
+#define msub( a, b ) _mm_sub_ps( a, b )
+#define mmul( a, b ) _mm_mul_ps( a, b )
+#define mdiv( a, b ) _mm_div_ps( a, b )
+#define mmin( a, b ) _mm_min_ps( a, b )
+#define mmax( a, b ) _mm_max_ps( a, b )
+#define mand( a, b ) _mm_and_ps( a, b )
+#define mandnot( a, b ) _mm_andnot_ps( a, b )
+#define mcmplt( a, b ) _mm_cmplt_ps( a, b )
+#define mcmple( a, b ) _mm_cmple_ps( a, b )
+#define mcmpgt( a, b ) _mm_cmpgt_ps( a, b )
+#define mcmpge( a, b ) _mm_cmpge_ps( a, b )
+#define mmask( a ) _mm_movemask_ps( a )
+#define mloadu( p ) _mm_loadu_ps( p )
+#define msqrt( a ) _mm_sqrt_ps( a )
+typedef __m128i mint;
+#define mtoint( a ) _mm_cvttps_epi32( a )
+#define mset1i( a ) _mm_set1_epi32( a )
+#define mori( a, b ) _mm_or_si128( a, b )
+#define mslli( a, n ) _mm_slli_epi32( a, n )
+#define mstoreui( p, a ) _mm_storeu_si128( (__m128i *)( p ), a )
+#define mloadi( p ) _mm_load_si128( (const __m128i *)( p ) )
+#define maddi( a, b ) _mm_add_epi32( a, b )
+#define mxori( a, b ) _mm_xor_si128( a, b )
+#define msrli( a, n ) _mm_srli_epi32( a, n )
+#define mtofloat( a ) _mm_cvtepi32_ps( a )
+#endif
+
+// Wide node, the bounds of all children are stored per axis so they can be tested with one SIMD sequence.
+// A child with count > 0 is a leaf and child indexes the leaf table, a child with count 0 is an interior node.
+struct ALIGN( 64 ) MBVHNode
+{
+	float bminx[MBVH_WIDTH], bminy[MBVH_WIDTH], bminz[MBVH_WIDTH];
+	float bmaxx[MBVH_WIDTH], bmaxy[MBVH_WIDTH], bmaxz[MBVH_WIDTH];
+	uint child[MBVH_WIDTH];
+	uint count[MBVH_WIDTH]; // primitives in a leaf, 0 for interior nodes, MBVH_EMPTY for unused slots
+};
+
+// MBVH_WIDTH triangles in SoA layout, with the edges precomputed for Moller-Trumbore
+struct ALIGN( 64 ) TriangleBlock
+{
+	float v0x[MBVH_WIDTH], v0y[MBVH_WIDTH], v0z[MBVH_WIDTH];
+	float e1x[MBVH_WIDTH], e1y[MBVH_WIDTH], e1z[MBVH_WIDTH];
+	float e2x[MBVH_WIDTH], e2y[MBVH_WIDTH], e2z[MBVH_WIDTH];
+	uint prim[MBVH_WIDTH]; // index into the primitives, MBVH_EMPTY for padding
+};
+
+// Triangles of a leaf live in blocks, anything else is intersected through Primitive::intersect
+struct MBVHLeaf
+{
+	uint firstBlock, blockCount;
+	uint firstPrim, primCount;
+};
+
+// Collapses the binary BVH into a MBVH_WIDTH-wide tree.
+// Based on "Shallow Bounding Volume Hierarchies for Fast SIMD Ray Tracing of Incoherent Rays" by Dammertz et al.
+class MBVH
+{
+  public:
+	MBVH( const BVH &bvh ) : primitives( bvh.getPrimitives() ), nodes( nullptr ), blocks( nullptr ), nodeCount( 0 ), blockCount( 0 )
+	{
+		// Every wide node consumes at least one interior binary node.
+		// MALLOC64 expects a multiple of the alignment.
+		nodes = (MBVHNode *)MALLOC64( max( 1u, bvh.getNodeCount() ) * sizeof( MBVHNode ) );
+
+		if ( primitives.empty() )
+		{
+			blocks = (TriangleBlock *)MALLOC64( sizeof( TriangleBlock ) );
+			return;
+		}
+
+		// Count the blocks up front, every leaf starts a new one
+		const BVHNode *binaryNodes = bvh.getNodes();
+		const uint *binaryIndices = bvh.getPrimIndices();
+		uint maxBlocks = 0;
+
+		for ( uint i = 0; i < bvh.getNodeCount(); i++ )
+		{
+			const BVHNode &node = binaryNodes[i];
+			uint triangles = 0;
+
+			for ( uint j = 0; j < node.count; j++ )
+			{
+				triangles += dynamic_cast<const Triangle *>( primitives[binaryIndices[node.leftFirst + j]] ) != nullptr;
+			}
+
+			maxBlocks += ( triangles + MBVH_WIDTH - 1 ) / MBVH_WIDTH;
+		}
+
+		blocks = (TriangleBlock *)MALLOC64( max( 1u, maxBlocks ) * sizeof( TriangleBlock ) );
+
+		if ( binaryNodes[0].isLeaf() )
+		{
+			// A single leaf still needs a wide root to hang from
+			MBVHNode &root = nodes[nodeCount++];
+			clear( root );
+			setChild( root, 0, binaryNodes[0], 0, binaryIndices );
+		}
+		else
+		{
+			collapse( binaryNodes, 0, binaryIndices );
+		}
+	}
+
+	MBVH( const MBVH & ) = delete;
+	MBVH &operator=( const MBVH & ) = delete;
+
+	~MBVH()
+	{
+		FREE64( nodes );
+		nodes = nullptr;
+
+		FREE64( blocks );
+		blocks = nullptr;
+	}
+
+	// Closest hit only, Primitive::getHit turns it into a shading record
+	Intersection intersect( const Ray &r ) const
+	{
+		Intersection closestHit;
+
+		if ( primitives.empty() )
+		{
+			return closestHit;
+		}
+
+		const RayPacket ray( r );
+
+		// Each wide node pushes at most MBVH_WIDTH entries per level
+		StackEntry stack[BVHDEPTH * MBVH_WIDTH];
+		uint stackPtr = 0;
+		stack[stackPtr++] = {0, 0, -FLT_MAX};
+		TraversalCounter counter;
+
+		while ( stackPtr > 0 )
+		{
+			const StackEntry entry = stack[--stackPtr];
+
+			if ( entry.tnear >= closestHit.t )
+			{
+				continue;
+			}
+
+			counter.nodes++;
+			if ( entry.count > 0 )
+			{
+				const MBVHLeaf &leaf = leaves[entry.child];
+				counter.tests += leaf.blockCount * MBVH_WIDTH + leaf.primCount;
+
+				for ( uint i = 0; i < leaf.blockCount; i++ )
+				{
+					intersectTriangles( blocks[leaf.firstBlock + i], ray, closestHit );
+				}
+
+				for ( uint i = 0; i < leaf.primCount; i++ )
+				{
+					const uint primId = primIndices[leaf.firstPrim + i];
+					if ( primitives[primId]->intersect( r, closestHit ) )
+					{
+						closestHit.primId = primId;
+					}
+				}
+				continue;
+			}
+
+			const MBVHNode &node = nodes[entry.child];
+			ALIGN( 32 ) float tnear[MBVH_WIDTH];
+			int mask = intersectChildren( node, ray, closestHit.t, tnear );
+
+			// Push the hit children far to near, so the nearest one is popped first
+			StackEntry hits[MBVH_WIDTH];
+			uint hitCount = 0;
+
+			while ( mask )
+			{
+				const int lane = bitScan( mask );
+				mask &= mask - 1;
+
+				if ( node.count[lane] == MBVH_EMPTY )
+				{
+					continue;
+				}
+
+				StackEntry e = {node.child[lane], node.count[lane], tnear[lane]};
+				uint j = hitCount++;
+				while ( j > 0 && hits[j - 1].tnear < e.tnear )
+				{
+					hits[j] = hits[j - 1];
+					j--;
+				}
+				hits[j] = e;
+			}
+
+			for ( uint i = 0; i < hitCount; i++ )
+			{
+				stack[stackPtr++] = hits[i];
+			}
+		}
+
+		return closestHit;
+	}
+
+	// Any hit closer than tmax, stops at the first one and never builds shading data
+	bool occluded( const Ray &r, float tmax ) const
+	{
+		if ( primitives.empty() )
+		{
+			return false;
+		}
+
+		const RayPacket ray( r );
+
+		// Children are pushed in any order, the first hit ends the query
+		StackEntry stack[BVHDEPTH * MBVH_WIDTH];
+		uint stackPtr = 0;
+		stack[stackPtr++] = {0, 0, -FLT_MAX};
+		TraversalCounter counter;
+
+		while ( stackPtr > 0 )
+		{
+			const StackEntry entry = stack[--stackPtr];
+
+			counter.nodes++;
+			if ( entry.count > 0 )
+			{
+				const MBVHLeaf &leaf = leaves[entry.child];
+
+				for ( uint i = 0; i < leaf.blockCount; i++ )
+				{
+					counter.tests += MBVH_WIDTH;
+					mfloat t, b0, b1;
+					if ( hitTriangles( blocks[leaf.firstBlock + i], ray, tmax, t, b0, b1 ) )
+					{
+						return true;
+					}
+				}
+
+				for ( uint i = 0; i < leaf.primCount; i++ )
+				{
+					counter.tests++;
+					Intersection isect;
+					isect.t = tmax;
+					if ( primitives[primIndices[leaf.firstPrim + i]]->intersect( r, isect ) )
+					{
+						return true;
+					}
+				}
+				continue;
+			}
+
+			const MBVHNode &node = nodes[entry.child];
+			ALIGN( 32 ) float tnear[MBVH_WIDTH];
+			int mask = intersectChildren( node, ray, tmax, tnear );
+
+			while ( mask )
+			{
+				const int lane = bitScan( mask );
+				mask &= mask - 1;
+
+				if ( node.count[lane] != MBVH_EMPTY )
+				{
+					stack[stackPtr++] = {node.child[lane], node.count[lane], tnear[lane]};
+				}
+			}
+		}
+
+		return false;
+	}
+
+  private:
+	vector<Primitive *> primitives;
+
+	MBVHNode *nodes;
+	TriangleBlock *blocks;
+	vector<MBVHLeaf> leaves;
+	vector<uint> primIndices; // primitives of the leaves that are not triangles
+	uint nodeCount;
+	uint blockCount;
+
+	struct StackEntry
+	{
+		uint child; // node index, or leaf index for leaves
+		uint count; // 0 for interior nodes
+		float tnear;
+	};
+
+	// Ray broadcast over all lanes
+	struct RayPacket
+	{
+		mfloat ox, oy, oz;
+		mfloat dx, dy, dz;
+		mfloat ix, iy, iz;
+
+		RayPacket( const Ray &r ) : ox( mset1( r.origin.x ) ), oy( mset1( r.origin.y ) ), oz( mset1( r.origin.z ) ),
+									dx( mset1( r.direction.x ) ), dy( mset1( r.direction.y ) ), dz( mset1( r.direction.z ) ),
+									ix( mset1( r.invDirection.x ) ), iy( mset1( r.invDirection.y ) ), iz( mset1( r.invDirection.z ) ) {}
+	};
+
+	static __inline int bitScan( int mask )
+	{
+#ifdef _MSC_VER
+		unsigned long idx;
+		_BitScanForward( &idx, mask );
+		return (int)idx;
+#else
+		return __builtin_ctz( mask );
+#endif
+	}
+
+	// Slab test against all children at once, returns a bit per child that is hit before tmax
+	static __inline int intersectChildren( const MBVHNode &node, const RayPacket &r, float tmax, float *tnear )
+	{
+		const mfloat tx1 = mmul( msub( mload( node.bminx ), r.ox ), r.ix );
+		const mfloat tx2 = mmul( msub( mload( node.bmaxx ), r.ox ), r.ix );
+		const mfloat ty1 = mmul( msub( mload( node.bminy ), r.oy ), r.iy );
+		const mfloat ty2 = mmul( msub( mload( node.bmaxy ), r.oy ), r.iy );
+		const mfloat tz1 = mmul( msub( mload( node.bminz ), r.oz ), r.iz );
+		const mfloat tz2 = mmul( msub( mload( node.bmaxz ), r.oz ), r.iz );
+
+		const mfloat tmin = mmax( mmax( mmin( tx1, tx2 ), mmin( ty1, ty2 ) ), mmin( tz1, tz2 ) );
+		const mfloat tfar = mmin( mmin( mmax( tx1, tx2 ), mmax( ty1, ty2 ) ), mmax( tz1, tz2 ) );
+
+		const mfloat hit = mand( mand( mcmpge( tfar, tmin ), mcmpgt( tfar, mset1( 0.f ) ) ), mcmplt( tmin, mset1( tmax ) ) );
+
+		mstore( tnear, tmin );
+		return mmask( hit );
+	}
+
+	// Moller-Trumbore against a whole block, returns a bit per triangle that is hit before tmax
+	static __inline int hitTriangles( const TriangleBlock &block, const RayPacket &r, float tmax, mfloat &t, mfloat &b0, mfloat &b1 )
+	{
+		const mfloat e1x = mload( block.e1x ), e1y = mload( block.e1y ), e1z = mload( block.e1z );
+		const mfloat e2x = mload( block.e2x ), e2y = mload( block.e2y ), e2z = mload( block.e2z );
+
+		// q = d x e2, a = e1 . q
+		const mfloat qx = msub( mmul( r.dy, e2z ), mmul( r.dz, e2y ) );
+		const mfloat qy = msub( mmul( r.dz, e2x ), mmul( r.dx, e2z ) );
+		const mfloat qz = msub( mmul( r.dx, e2y ), mmul( r.dy, e2x ) );
+		const mfloat a = madd( madd( mmul( e1x, qx ), mmul( e1y, qy ) ), mmul( e1z, qz ) );
+
+		// s = ( o - v0 ) / a
+		const mfloat invA = mdiv( mset1( 1.f ), a );
+		const mfloat sx = mmul( msub( r.ox, mload( block.v0x ) ), invA );
+		const mfloat sy = mmul( msub( r.oy, mload( block.v0y ) ), invA );
+		const mfloat sz = mmul( msub( r.oz, mload( block.v0z ) ), invA );
+
+		// r = s x e1
+		const mfloat rx = msub( mmul( sy, e1z ), mmul( sz, e1y ) );
+		const mfloat ry = msub( mmul( sz, e1x ), mmul( sx, e1z ) );
+		const mfloat rz = msub( mmul( sx, e1y ), mmul( sy, e1x ) );
+
+		b0 = madd( madd( mmul( sx, qx ), mmul( sy, qy ) ), mmul( sz, qz ) );
+		b1 = madd( madd( mmul( rx, r.dx ), mmul( ry, r.dy ) ), mmul( rz, r.dz ) );
+		t = madd( madd( mmul( e2x, rx ), mmul( e2y, ry ) ), mmul( e2z, rz ) );
+
+		// Not parallel, within the triangle and in front of the origin, padding lanes have a = 0
+		const mfloat absA = mandnot( mset1( -0.f ), a );
+		const mfloat zero = mset1( 0.f );
+		mfloat hit = mcmpgt( absA, mset1( EPSILON ) );
+		hit = mand( hit, mand( mcmpge( b0, zero ), mcmpge( b1, zero ) ) );
+		hit = mand( hit, mcmple( madd( b0, b1 ), mset1( 1.f ) ) );
+		hit = mand( hit, mand( mcmpge( t, zero ), mcmplt( t, mset1( tmax ) ) ) );
+
+		return mmask( hit );
+	}
+
+	// Updates isect when one of the triangles in the block is closer
+	static __inline void intersectTriangles( const TriangleBlock &block, const RayPacket &r, Intersection &isect )
+	{
+		mfloat t, b0, b1;
+		int mask = hitTriangles( block, r, isect.t, t, b0, b1 );
+		if ( !mask )
+		{
+			return;
+		}
+
+		ALIGN( 32 ) float ts[MBVH_WIDTH], b0s[MBVH_WIDTH], b1s[MBVH_WIDTH];
+		mstore( ts, t );
+		mstore( b0s, b0 );
+		mstore( b1s, b1 );
+
+		while ( mask )
+		{
+			const int lane = bitScan( mask );
+			mask &= mask - 1;
+
+			if ( ts[lane] < isect.t )
+			{
+				isect.t = ts[lane];
+				isect.primId = block.prim[lane];
+				isect.u = b0s[lane];
+				isect.v = b1s[lane];
+			}
+		}
+	}
+
+	static void clear( MBVHNode &node )
+	{
+		for ( int i = 0; i < MBVH_WIDTH; i++ )
+		{
+			node.bminx[i] = node.bminy[i] = node.bminz[i] = 0.f;
+			node.bmaxx[i] = node.bmaxy[i] = node.bmaxz[i] = 0.f;
+			node.child[i] = 0;
+			node.count[i] = MBVH_EMPTY;
+		}
+	}
+
+	// Collects the primitives below a binary node, fails once there are more than fit in one block
+	static bool gather( const BVHNode *binaryNodes, uint binaryIdx, const uint *binaryIndices, uint *prims, uint &primCount )
+	{
+		const BVHNode &node = binaryNodes[binaryIdx];
+
+		if ( !node.isLeaf() )
+		{
+			return gather( binaryNodes, node.left( binaryIdx ), binaryIndices, prims, primCount ) &&
+				   gather( binaryNodes, node.right(), binaryIndices, prims, primCount );
+		}
+
+		if ( primCount + node.count > MBVH_WIDTH )
+		{
+			return false;
+		}
+
+		for ( uint i = 0; i < node.count; i++ )
+		{
+			prims[primCount++] = binaryIndices[node.leftFirst + i];
+		}
+		return true;
+	}
+
+	// Packs primitives into triangle blocks and a list of remaining primitives
+	uint createLeaf( const uint *prims, uint count )
+	{
+		MBVHLeaf leaf;
+		leaf.firstBlock = blockCount;
+		leaf.blockCount = 0;
+		leaf.firstPrim = primIndices.size();
+		leaf.primCount = 0;
+
+		uint lane = MBVH_WIDTH;
+
+		for ( uint i = 0; i < count; i++ )
+		{
+			const uint prim = prims[i];
+			const Triangle *tri = dynamic_cast<const Triangle *>( primitives[prim] );
+
+			if ( !tri )
+			{
+				primIndices.push_back( prim );
+				leaf.primCount++;
+				continue;
+			}
+
+			if ( lane == MBVH_WIDTH )
+			{
+				TriangleBlock &block = blocks[blockCount++];
+				memset( &block, 0, sizeof( TriangleBlock ) );
+				for ( int j = 0; j < MBVH_WIDTH; j++ )
+				{
+					block.prim[j] = MBVH_EMPTY;
+				}
+				leaf.blockCount++;
+				lane = 0;
+			}
+
+			TriangleBlock &block = blocks[blockCount - 1];
+			const vec3 e1 = tri->v1 - tri->v0;
+			const vec3 e2 = tri->v2 - tri->v0;
+			block.v0x[lane] = tri->v0.x, block.v0y[lane] = tri->v0.y, block.v0z[lane] = tri->v0.z;
+			block.e1x[lane] = e1.x, block.e1y[lane] = e1.y, block.e1z[lane] = e1.z;
+			block.e2x[lane] = e2.x, block.e2y[lane] = e2.y, block.e2z[lane] = e2.z;
+			block.prim[lane] = prim;
+			lane++;
+		}
+
+		leaves.push_back( leaf );
+		return leaves.size() - 1;
+	}
+
+	static void setBounds( MBVHNode &node, int lane, const BVHNode &binaryNode )
+	{
+		node.bminx[lane] = binaryNode.bmin[0];
+		node.bminy[lane] = binaryNode.bmin[1];
+		node.bminz[lane] = binaryNode.bmin[2];
+		node.bmaxx[lane] = binaryNode.bmax[0];
+		node.bmaxy[lane] = binaryNode.bmax[1];
+		node.bmaxz[lane] = binaryNode.bmax[2];
+	}
+
+	// Copies the bounds of a binary node into a lane, leaves are converted on the spot
+	void setChild( MBVHNode &node, int lane, const BVHNode &binaryNode, uint childIdx, const uint *binaryIndices )
+	{
+		setBounds( node, lane, binaryNode );
+
+		if ( binaryNode.isLeaf() )
+		{
+			node.child[lane] = createLeaf( binaryIndices + binaryNode.leftFirst, binaryNode.count );
+			node.count[lane] = binaryNode.count;
+		}
+		else
+		{
+			node.child[lane] = childIdx;
+			node.count[lane] = 0;
+		}
+	}
+
+	static float area( const BVHNode &node )
+	{
+		aabb bounds( node.bmin4, node.bmax4 );
+		return bounds.Area();
+	}
+
+	// Pulls up grandchildren until the node is full, always opening the child with the largest surface area.
+	// Subtrees that fit in a single triangle block become one leaf, so the blocks are not mostly padding.
+	uint collapse( const BVHNode *binaryNodes, uint binaryIdx, const uint *binaryIndices )
+	{
+		uint children[MBVH_WIDTH];
+		int childCount = 2;
+		children[0] = binaryNodes[binaryIdx].left( binaryIdx );
+		children[1] = binaryNodes[binaryIdx].right();
+
+		uint prims[MBVH_WIDTH];
+		uint primCount;
+
+		while ( childCount < MBVH_WIDTH )
+		{
+			int best = -1;
+			float bestArea = -1.f;
+
+			for ( int i = 0; i < childCount; i++ )
+			{
+				const BVHNode &child = binaryNodes[children[i]];
+				primCount = 0;
+				if ( !child.isLeaf() && area( child ) > bestArea && !gather( binaryNodes, children[i], binaryIndices, prims, primCount ) )
+				{
+					best = i;
+					bestArea = area( child );
+				}
+			}
+
+			if ( best == -1 )
+			{
+				break;
+			}
+
+			const uint opened = children[best];
+			children[best] = binaryNodes[opened].left( opened );
+			children[childCount++] = binaryNodes[opened].right();
+		}
+
+		const uint idx = nodeCount++;
+		clear( nodes[idx] );
+
+		for ( int i = 0; i < childCount; i++ )
+		{
+			const BVHNode &child = binaryNodes[children[i]];
+			primCount = 0;
+
+			if ( child.isLeaf() || !gather( binaryNodes, children[i], binaryIndices, prims, primCount ) )
+			{
+				setChild( nodes[idx], i, child, child.isLeaf() ? 0 : collapse( binaryNodes, children[i], binaryIndices ), binaryIndices );
+				continue;
+			}
+
+			setBounds( nodes[idx], i, child );
+			nodes[idx].child[i] = createLeaf( prims, primCount );
+			nodes[idx].count[i] = primCount;
+		}
+
+		return idx;
+	}
+};
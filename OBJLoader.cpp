@@ -3,7 +3,7 @@
 #include "tiny_obj_loader.h"
 
 // Based on example on https://github.com/syoyo/tinyobjloader
-vector<Primitive *> loadOBJ( const char *filename, const Material &defaultMat )
+vector<Primitive *> loadOBJ( const char *filename, uint matIdx )
 {
 	vector<Primitive *> result = vector<Primitive *>();
 
@@ -62,7 +62,7 @@ vector<Primitive *> loadOBJ( const char *filename, const Material &defaultMat )
 			// TODO: get material from .mtl file
 			shapes[s].mesh.material_ids[f];
 
-			result.push_back( new Triangle( defaultMat, verts, uv ) );
+			result.push_back( new Triangle( matIdx, verts, uv ) );
 		}
 	}
 
@@ -1,4 +1,4 @@
 #pragma once
 
 // Based on example on https://github.com/syoyo/tinyobjloader
-vector<Primitive *> loadOBJ( const char *filename, const Material &defaultMat );
\ No newline at end of file
+vector<Primitive *> loadOBJ( const char *filename, uint matIdx );
\ No newline at end of file
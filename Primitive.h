@@ -3,18 +3,36 @@
 struct Primitive
 {
 	vec3 origin;
-	Material mat;
+	uint matIdx;
 
-	Primitive()
-	{
-		mat.albedo = vec3();
-		mat.emission = vec3();
-	}
+	Primitive() : matIdx( 0 ) {}
+
+	Primitive( vec3 origin, uint matIdx ) : origin( origin ), matIdx( matIdx ) {}
+
+	// Scenes hold and delete spheres and triangles through Primitive pointers
+	virtual ~Primitive() = default;
 
-	Primitive( vec3 origin, Material mat ) : origin( origin ), mat( mat ) {}
+	// Updates t, u and v of isect and returns true when the ray hits closer than isect.t
+	virtual bool intersect( const Ray &ray, Intersection &isect ) const = 0;
+
+	// Builds the shading record for an intersection found by intersect
+	virtual Hit getHit( const Ray &ray, const Intersection &isect ) const = 0;
 
-	virtual Hit hit( const Ray &ray ) const = 0;
 	virtual aabb volume() const = 0;
+
+	// Light sampling, only used on primitives with an emissive material.
+	// Picks a point on the surface that can be seen from `from`, using u1 and u2 in [0, 1).
+	// pdf is per unit solid angle around `from`, 0 when there is nothing to sample.
+	virtual vec3 samplePoint( const vec3 &from, float u1, float u2, float &pdf ) const = 0;
+
+	// The pdf samplePoint has for point, seen from `from`
+	virtual float pointPdf( const vec3 &from, const vec3 &point ) const = 0;
+
+	Hit hit( const Ray &ray ) const
+	{
+		Intersection isect;
+		return intersect( ray, isect ) ? getHit( ray, isect ) : Hit();
+	}
 };
 
 struct Sphere : public Primitive
@@ -22,13 +40,10 @@ struct Sphere : public Primitive
 	float radius;
 	float r2;
 
-	Sphere( vec3 origin, float radius, Material mat ) : Primitive( origin, mat ), radius( radius ), r2( radius * radius ) {}
+	Sphere( vec3 origin, float radius, uint matIdx ) : Primitive( origin, matIdx ), radius( radius ), r2( radius * radius ) {}
 
-	Hit hit( const Ray &r ) const override
+	bool intersect( const Ray &r, Intersection &isect ) const override
 	{
-		Hit h = Hit();
-		h.hitType = 0;
-
 		float a = r.direction.dot( r.direction );
 		float b = ( 2.f * r.direction ).dot( r.origin - origin );
 		float c = ( r.origin - origin ).dot( r.origin - origin ) - r2;
@@ -38,7 +53,7 @@ struct Sphere : public Primitive
 
 		if ( d < 0 ) // No hits
 		{
-			return h;
+			return false;
 		}
 		else if ( d == 0 ) // One hit
 		{
@@ -47,33 +62,8 @@ struct Sphere : public Primitive
 
 			if ( t < 0 )
 			{
-				return h;
+				return false;
 			}
-
-			h.t = t;
-			h.coordinates = r( t );
-			h.mat = mat;
-
-			vec3 normal = h.coordinates - origin;
-			normal.normalize();
-			h.normal = normal;
-
-			float dot = normal.dot( r.direction );
-
-			if ( dot > 0 ) // inside out
-			{
-				h.hitType = -1;
-			}
-			else if ( dot < 0 ) // outside in
-			{
-				h.hitType = 1;
-			}
-
-			// Calculate UV coordinates for the texture
-			h.u = 0.5f + atan2( normal.y, normal.x ) / 2 * PI;
-			h.v = 0.5f - asin( normal.y ) / PI;
-
-			return h;
 		}
 		else // Two hits
 		{
@@ -83,52 +73,48 @@ struct Sphere : public Primitive
 			if ( t1 > 0 )
 			{
 				// Outside in
-				h.hitType = 1;
-				h.t = t1;
-				h.coordinates = r( t1 );
-
-				h.mat = mat;
-
-				vec3 normal = h.coordinates - origin;
-				normal.normalize();
-				h.normal = normal;
-
-				// Calculate UV coordinates for the texture
-				h.u = 0.5f + atan2( normal.y, normal.x ) / 2 * PI;
-				h.v = 0.5f - asin( normal.y ) / PI;
-
-				return h;
+				t = t1;
 			}
-			else if ( t1 < 0 && t2 > 0 )
+			else if ( t2 > 0 )
 			{
 				// This situation happens when you start from within the sphere
-				h.hitType = -1;
-				h.t = t2;
-
-				h.coordinates = r( t2 );
-				h.mat = mat;
-
-				vec3 normal = h.coordinates - origin;
-				normal.normalize();
-				h.normal = normal;
-
-				// Calculate UV coordinates for the texture
-				h.u = 0.5f + atan2( normal.y, normal.x ) / 2 * PI;
-				h.v = 0.5f - asin( normal.y ) / PI;
-
-				return h;
-			}
-			else if ( t1 < 0 && t2 < 0 )
-			{
-				// No hits
-				return h;
+				t = t2;
 			}
 			else
 			{
-				// Some weird situation that I didn't account for
-				return h;
+				// No hits
+				return false;
 			}
 		}
+
+		if ( t >= isect.t )
+		{
+			return false;
+		}
+
+		isect.t = t;
+		return true;
+	}
+
+	Hit getHit( const Ray &r, const Intersection &isect ) const override
+	{
+		Hit h = Hit();
+		h.t = isect.t;
+		h.coordinates = r( isect.t );
+		h.matIdx = matIdx;
+
+		vec3 normal = h.coordinates - origin;
+		normal.normalize();
+		h.normal = normal;
+
+		// Inside out when the ray leaves the sphere
+		h.hitType = normal.dot( r.direction ) > 0 ? -1 : 1;
+
+		// Calculate UV coordinates for the texture
+		h.u = 0.5f + atan2( normal.y, normal.x ) / 2 * PI;
+		h.v = 0.5f - asin( normal.y ) / PI;
+
+		return h;
 	}
 
 	aabb volume() const override
@@ -136,6 +122,48 @@ struct Sphere : public Primitive
 		aabb bounds = aabb( origin - vec3( radius + EPSILON, radius + EPSILON, radius + EPSILON ), origin + vec3( radius + EPSILON, radius + EPSILON, radius + EPSILON ) );
 		return bounds;
 	}
+
+	// Uniform over the cone of directions the sphere covers, so every sample lands on the visible side.
+	// From PBRT, 3rd edition, section 14.2.2
+	vec3 samplePoint( const vec3 &from, float u1, float u2, float &pdf ) const override
+	{
+		const vec3 toCenter = origin - from;
+		const float dc2 = toCenter.dot( toCenter );
+		if ( dc2 <= r2 )
+		{
+			// Inside the sphere there is no cone to sample
+			pdf = 0.f;
+			return origin;
+		}
+
+		const float dc = sqrtf( dc2 );
+		const float cosThetaMax = sqrtf( max( 0.f, 1.f - r2 / dc2 ) );
+		const float cosTheta = 1.f - u1 + u1 * cosThetaMax;
+		const float sinTheta = sqrtf( max( 0.f, 1.f - cosTheta * cosTheta ) );
+		const float phi = 2.f * PI * u2;
+
+		const Basis basis( toCenter * ( 1.f / dc ) );
+		const vec3 direction = basis.toWorld( vec3( sinTheta * cosf( phi ), sinTheta * sinf( phi ), cosTheta ) );
+
+		// Distance to the near side of the sphere along the sampled direction
+		const float distance = dc * cosTheta - sqrtf( max( 0.f, r2 - dc2 * sinTheta * sinTheta ) );
+
+		pdf = 1.f / ( 2.f * PI * ( 1.f - cosThetaMax ) );
+		return from + direction * distance;
+	}
+
+	float pointPdf( const vec3 &from, const vec3 &point ) const override
+	{
+		const vec3 toCenter = origin - from;
+		const float dc2 = toCenter.dot( toCenter );
+		if ( dc2 <= r2 )
+		{
+			return 0.f;
+		}
+
+		const float cosThetaMax = sqrtf( max( 0.f, 1.f - r2 / dc2 ) );
+		return 1.f / ( 2.f * PI * ( 1.f - cosThetaMax ) );
+	}
 };
 
 // Deprecated since AABB cannot be easily determined for an infinite plane
@@ -203,7 +231,7 @@ struct Triangle : public Primitive
 	vec3 v0, v1, v2;
 	vec2 uv0, uv1, uv2;
 
-	Triangle( Material mat, vec3 *verteces, vec2 *uv ) : Primitive( vec3(), mat )
+	Triangle( uint matIdx, vec3 *verteces, vec2 *uv ) : Primitive( vec3(), matIdx )
 	{
 		v0 = verteces[0];
 		v1 = verteces[1];
@@ -217,24 +245,19 @@ struct Triangle : public Primitive
 	}
 
 	// Based on ScratchaPixel's implementation
-	Hit hit( const Ray &ray ) const override
+	bool intersect( const Ray &ray, Intersection &isect ) const override
 	{
-		Hit h = Hit();
-
 		// Edges
 		const vec3 &edge_1 = v1 - v0;
 		const vec3 &edge_2 = v2 - v0;
 
-		// Normal
-		const vec3 &n = edge_1.cross( edge_2 ).normalized();
-
 		const vec3 &q = ray.direction.cross( edge_2 );
 		const float a = edge_1.dot( q );
 
 		// Parallel?
 		if ( abs( a ) <= EPSILON )
 		{
-			return h;
+			return false;
 		}
 
 		const vec3 &s = ( ray.origin - v0 ) * ( 1.f / a );
@@ -248,46 +271,88 @@ struct Triangle : public Primitive
 		// Are we within the triangle?
 		if ( b0 < 0.f || b1 < 0.f || b2 < 0.f )
 		{
-			return h;
+			return false;
 		}
 
 		// We have a hit!
 		const float t = edge_2.dot( r );
-		if ( t >= 0.f )
+		if ( t < 0.f || t >= isect.t )
 		{
-			// From what direction do we hit the triangle? Inside or Outside?
-			if ( n.dot( ray.direction ) >= 0.f )
-			{
-				h.hitType = -1;
-			}
-			else
-			{
-				h.hitType = 1;
-			}
+			return false;
+		}
 
-			h.coordinates = ray( t );
-			h.t = t;
-			h.mat = mat;
-			h.normal = n;
+		isect.t = t;
+		isect.u = b0;
+		isect.v = b1;
+		return true;
+	}
 
-			// Calculate UV
-			h.u = b0 * uv0.x + b1 * uv1.x + b2 * uv2.x;
-			h.v = b0 * uv0.y + b1 * uv1.y + b2 * uv2.y;
-			return h;
+	Hit getHit( const Ray &ray, const Intersection &isect ) const override
+	{
+		Hit h = Hit();
+		const float b0 = isect.u;
+		const float b1 = isect.v;
+		const float b2 = 1.f - b0 - b1;
+
+		// Normal
+		const vec3 &n = ( v1 - v0 ).cross( v2 - v0 ).normalized();
+
+		// From what direction do we hit the triangle? Inside or Outside?
+		if ( n.dot( ray.direction ) >= 0.f )
+		{
+			h.hitType = -1;
 		}
 		else
 		{
-			return h;
+			h.hitType = 1;
 		}
+
+		h.coordinates = ray( isect.t );
+		h.t = isect.t;
+		h.matIdx = matIdx;
+		h.normal = n;
+
+		// Calculate UV
+		h.u = b0 * uv0.x + b1 * uv1.x + b2 * uv2.x;
+		h.v = b0 * uv0.y + b1 * uv1.y + b2 * uv2.y;
+		return h;
 	}
 
 	aabb volume() const override
 	{
 		aabb bounds = aabb();
 		bounds.Reset();
-		bounds.Grow( vec3( v0.x + EPSILON, v0.y + EPSILON, v0.z + EPSILON ) );
-		bounds.Grow( vec3( v1.x + EPSILON, v1.y + EPSILON, v1.z + EPSILON ) );
-		bounds.Grow( vec3( v2.x + EPSILON, v2.y + EPSILON, v2.z + EPSILON ) );
+		bounds.Grow( v0 );
+		bounds.Grow( v1 );
+		bounds.Grow( v2 );
+		bounds.Grow( bounds.bmin3 - vec3( EPSILON ) );
+		bounds.Grow( bounds.bmax3 + vec3( EPSILON ) );
 		return bounds;
 	}
-};
\ No newline at end of file
+
+	// Uniform over the area, converted to solid angle. Both sides emit.
+	vec3 samplePoint( const vec3 &from, float u1, float u2, float &pdf ) const override
+	{
+		const float su = sqrtf( u1 );
+		const vec3 point = v0 * ( 1.f - su ) + v1 * ( su * ( 1.f - u2 ) ) + v2 * ( su * u2 );
+
+		pdf = pointPdf( from, point );
+		return point;
+	}
+
+	float pointPdf( const vec3 &from, const vec3 &point ) const override
+	{
+		const vec3 n = ( v1 - v0 ).cross( v2 - v0 );
+		const float area = 0.5f * n.length();
+		const vec3 toPoint = point - from;
+		const float distance2 = toPoint.dot( toPoint );
+		const float cosLight = abs( n.dot( toPoint ) ) / ( 2.f * area * sqrtf( distance2 ) );
+
+		if ( cosLight <= EPSILON )
+		{
+			return 0.f;
+		}
+
+		return distance2 / ( cosLight * area );
+	}
+};
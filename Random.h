@@ -0,0 +1,93 @@
+#pragma once
+
+// xoshiro128+ (Blackman and Vigna, http://prng.di.unimi.it/), small enough for every path to carry its own generator.
+// A generator is seeded from the pixel, the sample within the pixel and the frame, so threads never share state
+// and the same frame always gets the same numbers.
+struct Random
+{
+	uint s[4];
+
+	Random() : Random( 0, 0, 0 ) {}
+
+	Random( uint pixel, uint sample, uint frame )
+	{
+		// Hashed into a splitmix sequence, so neighbouring pixels start far apart. The state can never be all zero
+		uint h = hash( pixel + hash( sample + hash( frame ) ) );
+		for ( int i = 0; i < 4; i++ )
+		{
+			h += 0x9e3779b9u;
+			s[i] = hash( h );
+		}
+	}
+
+	uint nextUInt()
+	{
+		const uint result = s[0] + s[3];
+		const uint t = s[1] << 9;
+
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = ( s[3] << 11 ) | ( s[3] >> 21 );
+
+		return result;
+	}
+
+	// Uniform in [0, 1), from the high bits, the low ones of xoshiro128+ are weak
+	float nextFloat() { return ( nextUInt() >> 8 ) * ( 1.f / 16777216.f ); }
+
+	// Finalizer of MurmurHash3
+	static uint hash( uint x )
+	{
+		x ^= x >> 16;
+		x *= 0x85ebca6bu;
+		x ^= x >> 13;
+		x *= 0xc2b2ae35u;
+		x ^= x >> 16;
+		return x;
+	}
+};
+
+// MBVH_WIDTH generators side by side. Lane i gives the same numbers as Random( pixels[i], sample, frame )
+struct RandomLanes
+{
+	mint s[4];
+
+	RandomLanes( const uint *pixels, uint sample, uint frame )
+	{
+		ALIGN( 32 ) uint lanes[4][MBVH_WIDTH];
+		for ( int i = 0; i < MBVH_WIDTH; i++ )
+		{
+			const Random r( pixels[i], sample, frame );
+			for ( int j = 0; j < 4; j++ )
+			{
+				lanes[j][i] = r.s[j];
+			}
+		}
+
+		for ( int j = 0; j < 4; j++ )
+		{
+			s[j] = mloadi( lanes[j] );
+		}
+	}
+
+	mint nextUInt()
+	{
+		const mint result = maddi( s[0], s[3] );
+		const mint t = mslli( s[1], 9 );
+
+		s[2] = mxori( s[2], s[0] );
+		s[3] = mxori( s[3], s[1] );
+		s[1] = mxori( s[1], s[2] );
+		s[0] = mxori( s[0], s[3] );
+		s[2] = mxori( s[2], t );
+		s[3] = mori( mslli( s[3], 11 ), msrli( s[3], 21 ) );
+
+		return result;
+	}
+
+	// The shifted value fits in 24 bits, so the signed conversion is exact
+	mfloat nextFloat() { return mmul( mtofloat( msrli( nextUInt(), 8 ) ), mset1( 1.f / 16777216.f ) ); }
+};
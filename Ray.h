@@ -1,7 +1,22 @@
 #pragma once
+
+// primId of an Intersection that did not hit anything
+#define NO_PRIMITIVE 0xFFFFFFFFu
+
+// What traversal keeps track of, the shading data is only looked up for the closest one
+struct Intersection
+{
+	Intersection() : t( FLT_MAX ), primId( NO_PRIMITIVE ), u( 0.f ), v( 0.f ) {}
+
+	float t;
+	uint primId; // index into the scene primitives
+	float u, v;  // barycentrics for triangles
+};
+
+// Shading record, built once from the closest Intersection
 struct Hit
 {
-	Hit() : hitType( 0 ), t( FLT_MAX ) {}
+	Hit() : hitType( 0 ), t( FLT_MAX ), matIdx( 0 ) {}
 
 	// World
 	int hitType; // -1 hit from inside; 0 no hit; 1 hit
@@ -12,13 +27,42 @@ struct Hit
 	// Texture mapping
 	float u;
 	float v;
-	Material mat;
+	uint matIdx; // index into the scene material table
 };
 
 struct Ray
 {
-	vec3 origin;
-	vec3 direction;
+	// Along +z from the origin, so a ray filled in later never carries a garbage inverse direction
+	Ray() : Ray( vec3( 0.f ), vec3( 0.f, 0.f, 1.f ) ) {}
+	Ray( const vec3 &origin, const vec3 &direction ) : origin( origin )
+	{
+		this->origin.dummy = 0.f;
+		setDirection( direction );
+	}
+
+	// Keeps the slab test data in step with the direction
+	void setDirection( const vec3 &d )
+	{
+		direction = d;
+		direction.dummy = 0.f;
+
+		// Division by zero yields +-inf, which the slab test handles without branching
+		invDirection = vec3( 1.f / d.x, 1.f / d.y, 1.f / d.z );
+		invDirection.dummy = 0.f;
+
+		for ( int i = 0; i < 3; i++ )
+		{
+			sign[i] = d[i] < 0.f;
+		}
+	}
+
+	union { __m128 origin4; vec3 origin; };
+	union { __m128 direction4; vec3 direction; };
+
+	// Precomputed for the slab test, set the direction through setDirection to keep these valid
+	union { __m128 invDirection4; vec3 invDirection; };
+	uint sign[3]; // 1 where the direction is negative
+
 	// Refraction index of current medium
 	float refractionIndex = 1.f;
 
@@ -27,3 +71,50 @@ struct Ray
 		return origin + t * direction;
 	}
 };
+
+// Square block of PACKETSIZE x PACKETSIZE primary rays, traced through the BVH together.
+// The bounds over all origins and inverse directions allow one conservative interval test per node for the whole packet.
+struct RayPacket
+{
+	Ray rays[PACKETSIZE * PACKETSIZE];
+
+	union { __m128 omin4; vec3 omin; };
+	union { __m128 omax4; vec3 omax; };
+	union { __m128 imin4; vec3 imin; };
+	union { __m128 imax4; vec3 imax; };
+	__m128 signMask4; // all bits set in the lanes where the direction is negative
+
+	// False when the direction signs differ between rays, the interval test is useless then
+	bool coherent;
+
+	// Call after filling in the rays
+	void computeBounds()
+	{
+		omin4 = omax4 = rays[0].origin4;
+		imin4 = imax4 = rays[0].invDirection4;
+		coherent = true;
+
+		for ( int i = 1; i < PACKETSIZE * PACKETSIZE; i++ )
+		{
+			const Ray &r = rays[i];
+			omin4 = _mm_min_ps( omin4, r.origin4 );
+			omax4 = _mm_max_ps( omax4, r.origin4 );
+			imin4 = _mm_min_ps( imin4, r.invDirection4 );
+			imax4 = _mm_max_ps( imax4, r.invDirection4 );
+
+			for ( int a = 0; a < 3; a++ )
+			{
+				coherent &= r.sign[a] == rays[0].sign[a];
+			}
+		}
+
+		// Axis-parallel rays have infinite inverse directions, which turn the interval products into NaN
+		for ( int a = 0; a < 3; a++ )
+		{
+			coherent &= fabsf( imin[a] ) < FLT_MAX && fabsf( imax[a] ) < FLT_MAX;
+		}
+
+		const uint *sign = rays[0].sign;
+		signMask4 = _mm_castsi128_ps( _mm_set_epi32( 0, -(int)sign[2], -(int)sign[1], -(int)sign[0] ) );
+	}
+};
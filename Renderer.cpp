@@ -1,145 +1,612 @@
 #include "precomp.h"
 
-Renderer::Renderer( vector<Primitive *> primitives ) : bvh( BVH( primitives ) )
+#ifdef USE_MBVH
+Renderer::Renderer( vector<Primitive *> primitives, vector<Material> materials, uint width, uint height, uint tileSize, uint threadCount ) : primitives( primitives ), materials( materials ), bvh( primitives ), mbvh( bvh ), scheduler( threadCount )
+#else
+Renderer::Renderer( vector<Primitive *> primitives, vector<Material> materials, uint width, uint height, uint tileSize, uint threadCount ) : primitives( primitives ), materials( materials ), bvh( primitives ), scheduler( threadCount )
+#endif
 {
-	currentIteration = 1;
+	init( width, height, tileSize );
+}
 
-	prebuffer = new vec3[SCRWIDTH * SCRHEIGHT];
+// The tree comes from the cache as it is, only the wide BVH is collapsed from it again
+#ifdef USE_MBVH
+Renderer::Renderer( const SceneCache &cache, uint width, uint height, uint tileSize, uint threadCount ) : primitives( cache.createPrimitives() ), materials( cache.getMaterials() ), bvh( primitives, cache.getNodes(), cache.getNodeCount(), cache.getPrimIndices() ), mbvh( bvh ), scheduler( threadCount )
+#else
+Renderer::Renderer( const SceneCache &cache, uint width, uint height, uint tileSize, uint threadCount ) : primitives( cache.createPrimitives() ), materials( cache.getMaterials() ), bvh( primitives, cache.getNodes(), cache.getNodeCount(), cache.getPrimIndices() ), scheduler( threadCount )
+#endif
+{
+	init( width, height, tileSize );
+}
 
-	for ( unsigned i = 0; i < SCRWIDTH * SCRHEIGHT; i++ )
+// The part of construction that does not depend on where the scene came from
+void Renderer::init( uint width, uint height, uint tileSize )
+{
+	prebufferR = prebufferG = prebufferB = prebufferLum2 = nullptr;
+	for ( uint i = 0; i < 3; i++ )
 	{
-		prebuffer[i] = vec3( 0.f, 0.f, 0.f );
+		frames[i] = nullptr;
 	}
 
-	buffer = new Pixel[SCRWIDTH * SCRHEIGHT];
+	cameraChanged = false;
+	stopRendering = false;
+	frameTime = 0.f;
+	maxIterations = ITERATIONS;
+	statsFile = nullptr;
+
+#ifdef USE_WAVEFRONT
+	// Camera rays spawn SAMPLES diffuse rays each, that is the most a batch ever holds
+	paths.resize( WAVEFRONT_BATCH * SAMPLES );
+	nextPaths.resize( WAVEFRONT_BATCH * SAMPLES );
+	pathHits.resize( WAVEFRONT_BATCH * SAMPLES );
+	pathContribution.resize( WAVEFRONT_BATCH * SAMPLES );
+	pathEmit.resize( WAVEFRONT_BATCH * SAMPLES );
 
-	for ( unsigned y = 0; y < SCRHEIGHT; y += TILESIZE )
+	// Every path of a pass takes as many light samples as it has branches, so the same bound holds for them
+	shadowSlots.resize( WAVEFRONT_BATCH * SAMPLES );
+	pathShadows.resize( WAVEFRONT_BATCH * SAMPLES );
+	shadowRays.resize( WAVEFRONT_BATCH * SAMPLES );
+#endif
+
+	resize( width, height, tileSize );
+
+	for ( uint i = 0; i < primitives.size(); i++ )
 	{
-		for ( unsigned x = 0; x < SCRWIDTH; x += TILESIZE )
+		if ( materials[primitives[i]->matIdx].type == EMIT_MAT )
 		{
-			tuple<int, int> element = make_pair( x, y );
-			tiles.push_back( element );
+			lights.push_back( i );
 		}
 	}
-
-	this->primitives = primitives;
 }
 
 Renderer::~Renderer()
 {
+	// The render thread uses everything below, so it goes first
+	if ( renderThread.joinable() )
+	{
+		stopRendering = true;
+		renderThread.join();
+	}
+
 	for ( unsigned i = 0; i < primitives.size(); i++ )
 	{
 		delete primitives[i];
 	}
 
-	delete[] prebuffer;
-	prebuffer = nullptr;
+	freeBuffers();
+
+	if ( statsFile )
+	{
+		fclose( statsFile );
+	}
+}
+
+// New frame buffers and tiles, the BVH is kept. Accumulation starts over
+void Renderer::resize( uint width, uint height, uint tileSize )
+{
+	// The render thread uses all of the buffers, so it is stopped while they are replaced and started again afterwards
+	const bool running = renderThread.joinable();
+	if ( running )
+	{
+		stopRendering = true;
+		renderThread.join();
+		stopRendering = false;
+	}
+
+	freeBuffers();
+
+	this->width = width;
+	this->height = height;
+	this->tileSize = tileSize;
+
+	// Rounded up to whole cache lines, aligned_alloc wants a multiple of the alignment
+	const size_t pixels = ( size_t( width ) * height + 15 ) & ~size_t( 15 );
+	prebufferR = (float *)MALLOC64( pixels * sizeof( float ) );
+	prebufferG = (float *)MALLOC64( pixels * sizeof( float ) );
+	prebufferB = (float *)MALLOC64( pixels * sizeof( float ) );
+	prebufferLum2 = (float *)MALLOC64( pixels * sizeof( float ) );
+
+	for ( uint i = 0; i < 3; i++ )
+	{
+		frames[i] = (Pixel *)MALLOC64( pixels * sizeof( Pixel ) );
+		memset( frames[i], 0, pixels * sizeof( Pixel ) );
+	}
+
+	backFrame = 0;
+	frontFrame = 1;
+	spareFrame = 2;
+
+	tiles.clear();
+	for ( unsigned y = 0; y < height; y += tileSize )
+	{
+		for ( unsigned x = 0; x < width; x += tileSize )
+		{
+			tuple<int, int> element = make_pair( x, y );
+			tiles.push_back( element );
+		}
+	}
+
+	// Morton order keeps tiles that are close on screen close in the list, and so on the same thread
+	sort( tiles.begin(), tiles.end(), [tileSize]( const tuple<int, int> &a, const tuple<int, int> &b ) {
+		return morton( get<0>( a ) / tileSize, get<1>( a ) / tileSize ) < morton( get<0>( b ) / tileSize, get<1>( b ) / tileSize );
+	} );
+
+	tileStates.resize( tiles.size() );
+	invalidatePrebuffer();
+
+	if ( running )
+	{
+		start();
+	}
+}
+
+void Renderer::freeBuffers()
+{
+	FREE64( prebufferR );
+	FREE64( prebufferG );
+	FREE64( prebufferB );
+	FREE64( prebufferLum2 );
+	prebufferR = prebufferG = prebufferB = prebufferLum2 = nullptr;
+
+	for ( uint i = 0; i < 3; i++ )
+	{
+		FREE64( frames[i] );
+		frames[i] = nullptr;
+	}
+}
+
+void Renderer::start()
+{
+	renderThread = thread( &Renderer::renderLoop, this );
+}
 
-	delete[] buffer;
-	buffer = nullptr;
+void Renderer::renderLoop()
+{
+	while ( !stopRendering )
+	{
+		renderFrame();
+	}
 }
 
 void Renderer::renderFrame()
 {
-	if ( currentIteration < ITERATIONS )
+	if ( applyCameraCommands() )
 	{
-#pragma omp parallel for
-		for ( int i = 0; i < tiles.size(); i++ )
+		invalidatePrebuffer();
+	}
+
+	if ( !converged )
+	{
+		// Once the camera moved, the rest of an accumulating iteration is skipped so new input never waits for it.
+		// The first iteration after a change always completes, or continuous input would never show a frame.
+		// A resize or the destructor stopping the render thread skips it the same way.
+		timer t;
+		const bool interruptible = currentIteration > 1;
+#ifdef USE_WAVEFRONT
+		const int pixels = width * height;
+		for ( int first = 0; first < pixels && !( interruptible && ( cameraChanged || stopRendering ) ); first += WAVEFRONT_BATCH )
 		{
-			int x = get<0>( tiles[i] );
-			int y = get<1>( tiles[i] );
+			const int last = min( first + WAVEFRONT_BATCH, pixels );
+			renderWavefront( first, last );
 
-			for ( unsigned dy = 0; dy < TILESIZE; dy++ )
+			const StageTimer resolving( ThreadStats::local().stats.resolveTime );
+			resolve( first, last - first, currentIteration );
+		}
+#else
+		scheduler.run( tiles.size(), [this, interruptible]( uint i ) {
+			if ( !( interruptible && ( cameraChanged || stopRendering ) ) )
 			{
-				for ( unsigned dx = 0; dx < TILESIZE; dx++ )
-				{
-					if ( ( x + dx ) < SCRWIDTH && ( y + dy ) < SCRHEIGHT )
-					{
-						prebuffer[( y + dy ) * SCRWIDTH + ( x + dx )] += shootRay( x + dx, y + dy, MAXRAYDEPTH );
-					}
-				}
+				renderTile( i );
 			}
+		} );
+
+		converged = all_of( tileStates.begin(), tileStates.end(), []( const TileState &state ) { return state.converged; } );
+#endif
+		if ( interruptible && ( cameraChanged || stopRendering ) )
+		{
+			// Partly rendered with the old camera, the prebuffer is cleared before the next iteration, its stats are dropped
+			ThreadStats::collect();
+			return;
 		}
+
 		currentIteration++;
+		converged = converged || currentIteration > maxIterations;
+		publishFrame();
+		frameTime = t.elapsed();
+
+		// The workers are idle until the next iteration, so their counters can be read
+		publishStats( ThreadStats::collect() );
 	}
 	else
 	{
 		// Prevent stupidly high framerate
-		Sleep( ( 1.f / MAX_IDLE_FPS ) * 1000 );
+		this_thread::sleep_for( chrono::milliseconds( int( 1000.f / MAX_IDLE_FPS ) ) );
+	}
+}
+
+// Returns whether the camera changed
+bool Renderer::applyCameraCommands()
+{
+	lock_guard<mutex> lock( cameraLock );
+
+	if ( cameraCommands.empty() )
+	{
+		return false;
+	}
+
+	for ( const function<void( Camera & )> &command : cameraCommands )
+	{
+		command( cam );
+	}
+
+	cameraCommands.clear();
+	cameraChanged = false;
+	return true;
+}
+
+void Renderer::queueCameraCommand( function<void( Camera & )> command )
+{
+	lock_guard<mutex> lock( cameraLock );
+	cameraCommands.push_back( command );
+	cameraChanged = true;
+}
+
+// Swaps the back frame, resolved tile by tile during the iteration, with the spare one
+void Renderer::publishFrame()
+{
+	backFrame = spareFrame.exchange( backFrame | FRESH_FRAME ) & ~FRESH_FRAME;
+}
+
+void Renderer::publishStats( const RenderStats &stats )
+{
+	lock_guard<mutex> lock( statsLock );
+	frameStats = stats;
+
+	if ( statsFile )
+	{
+		fprintf( statsFile, "%u,%.3f,", currentIteration - 1, frameTime.load() );
+		stats.writeCsv( statsFile );
+		fprintf( statsFile, "\n" );
+	}
+}
+
+RenderStats Renderer::getStats()
+{
+	lock_guard<mutex> lock( statsLock );
+	return frameStats;
+}
+
+bool Renderer::recordStats( const char *file )
+{
+	lock_guard<mutex> lock( statsLock );
+
+	if ( statsFile )
+	{
+		fclose( statsFile );
+		statsFile = nullptr;
+	}
+
+	if ( !file )
+	{
+		return true;
+	}
+
+	statsFile = fopen( file, "w" );
+	if ( !statsFile )
+	{
+		return false;
+	}
+
+	fprintf( statsFile, "iteration,frame_ms,%s\n", RenderStats::csvHeader() );
+	return true;
+}
+
+Pixel *Renderer::getOutput()
+{
+	if ( spareFrame & FRESH_FRAME )
+	{
+		frontFrame = spareFrame.exchange( frontFrame ) & ~FRESH_FRAME;
+	}
+
+	return frames[frontFrame];
+}
+
+// Linear RGB, the accumulated average of every pixel before gamma correction and clamping
+void Renderer::getRadiance( float *rgb ) const
+{
+	for ( uint i = 0; i < tiles.size(); i++ )
+	{
+		const uint x = get<0>( tiles[i] );
+		const uint y = get<1>( tiles[i] );
+#ifdef USE_WAVEFRONT
+		const float importance = 1.f / max( 1u, currentIteration - 1 );
+#else
+		const float importance = 1.f / max( 1u, tileStates[i].iterations );
+#endif
+
+		for ( uint dy = 0; dy < tileSize && y + dy < height; dy++ )
+		{
+			for ( uint dx = 0; dx < tileSize && x + dx < width; dx++ )
+			{
+				const uint p = ( y + dy ) * width + ( x + dx );
+				rgb[p * 3 + 0] = prebufferR[p] * importance;
+				rgb[p * 3 + 1] = prebufferG[p] * importance;
+				rgb[p * 3 + 2] = prebufferB[p] * importance;
+			}
+		}
+	}
+}
+
+void Renderer::renderTile( uint tile )
+{
+	const uint x = get<0>( tiles[tile] );
+	const uint y = get<1>( tiles[tile] );
+	TileState &state = tileStates[tile];
+	RenderStats &stats = ThreadStats::local().stats;
+
+	if ( !state.converged )
+	{
+		const StageTimer tracing( stats.shadeTime );
+		stats.primaryRays += min( tileSize, width - x ) * min( tileSize, height - y );
+		traceTile( x, y );
+		state.iterations++;
+#ifdef ADAPTIVE_SAMPLING
+		state.converged = state.iterations >= ADAPTIVE_MIN_ITERATIONS && tileError( x, y, state.iterations ) < ADAPTIVE_THRESHOLD;
+#endif
+	}
+
+	// Resolved right away, while the accumulated colors of the tile are still in cache.
+	// Retired tiles are resolved as well, the back frame holds an older iteration.
+	const StageTimer resolving( stats.resolveTime );
+	for ( uint dy = 0; dy < tileSize && y + dy < height; dy++ )
+	{
+		resolve( ( y + dy ) * width + x, min( tileSize, width - x ), state.iterations );
+	}
+}
+
+// Largest standard error of the pixel means in a tile, measured on screen: after gamma correction and clamping.
+// Dark pixels need fewer samples than the raw variance suggests, and saturated ones none at all.
+// The worst pixel decides, a small noisy region such as a penumbra would disappear in the average of a smooth tile.
+float Renderer::tileError( uint x, uint y, uint iterations ) const
+{
+	const float n = float( iterations );
+	float worst = 0.f;
+
+	for ( uint dy = 0; dy < tileSize && y + dy < height; dy++ )
+	{
+		for ( uint dx = 0; dx < tileSize && x + dx < width; dx++ )
+		{
+			const uint p = ( y + dy ) * width + ( x + dx );
+			const float mean = luminance( prebufferR[p], prebufferG[p], prebufferB[p] ) / n;
+			const float variance = max( 0.f, ( prebufferLum2[p] / n - mean * mean ) * n / ( n - 1.f ) );
+			const float error = sqrtf( variance / n );
+
+			worst = max( worst, sqrtf( min( mean + error, 1.f ) ) - sqrtf( min( mean, 1.f ) ) );
+		}
+	}
+
+	return worst;
+}
+
+void Renderer::traceTile( int x, int y )
+{
+#ifdef USE_PACKETS
+	if ( tileSize % PACKETSIZE == 0 && x + tileSize <= width && y + tileSize <= height )
+	{
+		for ( unsigned py = 0; py < tileSize; py += PACKETSIZE )
+		{
+			for ( unsigned px = 0; px < tileSize; px += PACKETSIZE )
+			{
+				shootPacket( x + px, y + py );
+			}
+		}
+		return;
+	}
+#endif
+	for ( unsigned dy = 0; dy < tileSize; dy++ )
+	{
+		for ( unsigned dx = 0; dx < tileSize; dx++ )
+		{
+			if ( ( x + dx ) < width && ( y + dy ) < height )
+			{
+				accumulate( ( y + dy ) * width + ( x + dx ), shootRay( x + dx, y + dy, MAXRAYDEPTH ) );
+			}
+		}
+	}
+}
+
+// Interleaves the bits of x and y
+uint Renderer::morton( uint x, uint y )
+{
+	uint code = 0;
+	for ( uint bit = 0; bit < 16; bit++ )
+	{
+		code |= ( ( x >> bit ) & 1 ) << ( 2 * bit );
+		code |= ( ( y >> bit ) & 1 ) << ( 2 * bit + 1 );
+	}
+	return code;
+}
+
+// Averages, gamma corrects and packs a run of pixels into the back frame
+void Renderer::resolve( uint first, uint count, uint iterations )
+{
+	const float importance = 1.f / float( iterations );
+	Pixel *frame = frames[backFrame];
+	const uint end = first + count;
+	uint i = first;
+
+	const mfloat scale = mset1( importance );
+	const mfloat zero = mset1( 0.f );
+	const mfloat one = mset1( 1.f );
+	const mfloat maxChannel = mset1( 255.f );
+	const mint alpha = mset1i( 0xFF000000 );
+	for ( ; i + MBVH_WIDTH <= end; i += MBVH_WIDTH )
+	{
+		const mfloat r = mmul( mmin( msqrt( mmax( mmul( mloadu( prebufferR + i ), scale ), zero ) ), one ), maxChannel );
+		const mfloat g = mmul( mmin( msqrt( mmax( mmul( mloadu( prebufferG + i ), scale ), zero ) ), one ), maxChannel );
+		const mfloat b = mmul( mmin( msqrt( mmax( mmul( mloadu( prebufferB + i ), scale ), zero ) ), one ), maxChannel );
+		mstoreui( frame + i, mori( mori( alpha, mslli( mtoint( r ), 16 ) ), mori( mslli( mtoint( g ), 8 ), mtoint( b ) ) ) );
+	}
+
+	for ( ; i < end; i++ )
+	{
+		frame[i] = rgb( gammaCorrect( vec3( prebufferR[i], prebufferG[i], prebufferB[i] ) * importance ) );
 	}
 }
 
 void Renderer::invalidatePrebuffer()
 {
-	for ( size_t i = 0; i < SCRWIDTH * SCRHEIGHT; i++ )
+	memset( prebufferR, 0, width * height * sizeof( float ) );
+	memset( prebufferG, 0, width * height * sizeof( float ) );
+	memset( prebufferB, 0, width * height * sizeof( float ) );
+	memset( prebufferLum2, 0, width * height * sizeof( float ) );
+
+	for ( TileState &state : tileStates )
 	{
-		prebuffer[i] = vec3( 0.f, 0.f, 0.f );
+		state.iterations = 0;
+		state.converged = false;
 	}
 
 	currentIteration = 1;
+	converged = false;
 }
 
 void Renderer::setCamera( Camera cam )
 {
-	this->cam = cam;
+	queueCameraCommand( [cam]( Camera &c ) { c = cam; } );
 }
 
-Camera *Renderer::getCamera()
+// A copy of the camera the render thread last applied commands to, queued commands are not in it yet.
+// The render thread only changes cam while it holds the lock
+Camera Renderer::getCamera()
 {
-	return &cam;
+	lock_guard<mutex> lock( cameraLock );
+	return cam;
 }
 
 // As preparation for iterative rendering
 void Renderer::moveCam( vec3 vec )
 {
-	invalidatePrebuffer();
-	cam.move( vec );
+	queueCameraCommand( [vec]( Camera &c ) { c.move( vec ); } );
 }
 
 // As preparation for iterative rendering
 void Renderer::rotateCam( vec3 vec )
 {
-	invalidatePrebuffer();
-	cam.rotate( vec );
+	queueCameraCommand( [vec]( Camera &c ) { c.rotate( vec ); } );
 }
 
 void Renderer::zoomCam( float deltaZoom )
 {
-	invalidatePrebuffer();
-	cam.zoom( deltaZoom, true );
+	queueCameraCommand( [deltaZoom]( Camera &c ) { c.zoom( deltaZoom, true ); } );
 }
 
 void Renderer::changeAperture( float deltaAperture )
 {
-	invalidatePrebuffer();
-	cam.changeAperture( deltaAperture, true );
+	queueCameraCommand( [deltaAperture]( Camera &c ) { c.changeAperture( deltaAperture, true ); } );
 }
 
 void Renderer::focusCam()
 {
-	invalidatePrebuffer();
-	Hit h = bvh.intersect( cam.focusRay() );
+	// Traced on the render thread when the command is applied, getCamera shows the distance from then on
+	queueCameraCommand( [this]( Camera &c ) { c.focusDistance = intersect( c.focusRay() ).t; } );
+}
 
-	cam.focusDistance = h.t;
+Intersection Renderer::intersectClosest( const Ray &r ) const
+{
+	const TraversalTimer timing;
+#ifdef USE_MBVH
+	return mbvh.intersect( r );
+#else
+	return bvh.intersect( r );
+#endif
 }
 
-Pixel *Renderer::getOutput() const
+Hit Renderer::intersect( const Ray &r ) const
 {
-	// currentSample - 1 because it is increased in the renderFrame() function in preparation of the next frame.
-	// Unfortunately, we are getting the current frame, so we get currentSample - 1.
-	float importance = 1.f / float( currentIteration - 1 );
-	for ( unsigned i = 0; i < SCRWIDTH * SCRHEIGHT; i++ )
+	const Intersection isect = intersectClosest( r );
+
+	if ( isect.primId == NO_PRIMITIVE )
 	{
-		buffer[i] = rgb( gammaCorrect( prebuffer[i] * importance ) );
+		return Hit();
 	}
 
-	return buffer;
+	return primitives[isect.primId]->getHit( r, isect );
+}
+
+bool Renderer::occluded( const Ray &r, float tmax ) const
+{
+	const TraversalTimer timing;
+#ifdef USE_MBVH
+	return mbvh.occluded( r, tmax );
+#else
+	return bvh.occluded( r, tmax );
+#endif
 }
 
 vec3 Renderer::shootRay( unsigned x, unsigned y, unsigned depth ) const
 {
-	Ray r = cam.getRay( x, y );
-	return shootRay( r, depth );
+	const uint pixel = y * width + x;
+	Random rng( pixel, 0, currentIteration );
+	const float u[4] = {rng.nextFloat(), rng.nextFloat(), rng.nextFloat(), rng.nextFloat()};
+	Ray r = cam.getRay( x, y, width, height, u );
+	return shootRay( r, depth, pixel );
+}
+
+// Traces the camera rays of a PACKETSIZE x PACKETSIZE block together and accumulates their shaded results
+void Renderer::shootPacket( unsigned x, unsigned y )
+{
+	// The camera samples of MBVH_WIDTH pixels at a time, the same numbers shootRay draws for them
+	ALIGN( 32 ) float u[4][PACKETSIZE * PACKETSIZE];
+	for ( unsigned i = 0; i < PACKETSIZE * PACKETSIZE; i += MBVH_WIDTH )
+	{
+		uint pixels[MBVH_WIDTH];
+		for ( unsigned j = 0; j < MBVH_WIDTH; j++ )
+		{
+			pixels[j] = ( y + ( i + j ) / PACKETSIZE ) * width + x + ( i + j ) % PACKETSIZE;
+		}
+
+		RandomLanes rng( pixels, 0, currentIteration );
+		for ( unsigned j = 0; j < 4; j++ )
+		{
+			mstore( &u[j][i], rng.nextFloat() );
+		}
+	}
+
+	RayPacket packet;
+	for ( unsigned i = 0; i < PACKETSIZE * PACKETSIZE; i++ )
+	{
+		const float pixelSample[4] = {u[0][i], u[1][i], u[2][i], u[3][i]};
+		packet.rays[i] = cam.getRay( x + i % PACKETSIZE, y + i / PACKETSIZE, width, height, pixelSample );
+	}
+	packet.computeBounds();
+
+	// Packets that diverge are traced ray by ray, through the MBVH when it is enabled
+	Intersection isects[PACKETSIZE * PACKETSIZE];
+	if ( packet.coherent )
+	{
+		const TraversalTimer timing;
+		bvh.intersect( packet, isects );
+	}
+	else
+	{
+		for ( int i = 0; i < PACKETSIZE * PACKETSIZE; i++ )
+		{
+			isects[i] = intersectClosest( packet.rays[i] );
+		}
+	}
+
+	for ( unsigned dy = 0; dy < PACKETSIZE; dy++ )
+	{
+		for ( unsigned dx = 0; dx < PACKETSIZE; dx++ )
+		{
+			const unsigned i = dy * PACKETSIZE + dx;
+			const Ray &r = packet.rays[i];
+			const Hit closestHit = isects[i].primId == NO_PRIMITIVE ? Hit() : primitives[isects[i].primId]->getHit( r, isects[i] );
+			const uint pixel = ( y + dy ) * width + ( x + dx );
+			accumulate( pixel, shade( r, closestHit, MAXRAYDEPTH, pixel ) );
+		}
+	}
 }
 
 __inline void clampFloat( float &val, float lo, float hi )
@@ -165,117 +632,491 @@ __inline void clampFloat( float &val, float lo, float hi )
 //	return r;
 //}
 
-// Random generator - needs to move somewhere else (?)
-std::random_device rd;
-std::mt19937 mt( rd() );
-std::uniform_real_distribution<float> uniform_dist( 0.f, 1.f );
+// Cosine weighted direction around the normal of a hit, pdf is per unit solid angle
+Ray diffuseRay( const Hit &hit, const Basis &basis, float &pdf, Random &rng )
+{
+	const float u1 = rng.nextFloat();
+	const float u2 = rng.nextFloat();
+	const vec3 direction = basis.toWorld( Sample::cosineSampleHemisphere( u1, u2, pdf ) );
 
-vec3 getPointOnHemi()
+	// Diffused ray with the calculated random direction, starting just above the hit point so it does not hit the same surface
+	return Ray( hit.coordinates + hit.normal * DIFFUSEBIAS, direction );
+}
+
+// Density with which diffuseRay picks direction
+float diffusePdf( const vec3 &normal, const vec3 &direction )
 {
-	float r1 = uniform_dist( mt );
-	float r2 = uniform_dist( mt );
+	return Sample::cosineHemispherePdf( dot( normal, direction ) );
+}
+
+// Power heuristic for combining light and BSDF samples, weight of the strategy that produced pdf
+float misWeight( float pdf, float otherPdf )
+{
+	return ( pdf * pdf ) / ( pdf * pdf + otherPdf * otherPdf );
+}
 
-	Sample s;
-	// vec3 point = s.cosineSampleHemisphere( r1, r2 ); // Does not work as expected!
-	vec3 point = s.uniformSampleHemisphere( r1, r2 );
+// Surfaces are shaded on the side the ray arrived from, the inside of a sphere that contains the camera for example
+Hit facingHit( Hit hit, const vec3 &direction )
+{
+	if ( dot( hit.normal, direction ) > 0.f )
+	{
+		hit.normal = -hit.normal;
+	}
 
-	return point;
+	return hit;
 }
 
-void createLocalCoordinateSystem( const vec3 &N, vec3 &Nt, vec3 &Nb )
+// Russian roulette: chance that a path goes on after a bounce that leaves it with this throughput.
+// The first bounces always continue, after that dim paths are ended early and the survivors weighted up.
+float survivalProbability( const vec3 &throughput, unsigned bounce )
 {
-	// This came out of my head - maybe there is better option
-	// However, two other things tested did not work (scratchapixel & gpu blog)
-	if ( abs( N.z ) > EPSILON )
+	if ( bounce < RUSSIAN_ROULETTE_DEPTH )
 	{
-		Nt.x = 1.5 * N.x; // arbitary
-		Nt.y = 1.5 * N.y; // arbitary
-		Nt.z = -( Nt.x * N.x + Nt.y * N.y ) / N.z;
+		return 1.f;
 	}
-	else if ( abs( N.y ) > EPSILON )
+
+	return min( max( throughput.x, max( throughput.y, throughput.z ) ), 0.95f );
+}
+
+// Next event estimation: light that reaches the surface straight from a point on a random light, with a shadow ray
+vec3 Renderer::sampleLight( const Hit &surface, const vec3 &BRDF, Random &rng, RenderStats &stats ) const
+{
+	Ray shadowRay;
+	float tmax;
+	vec3 contribution;
+	if ( !sampleLightRay( surface, BRDF, rng, shadowRay, tmax, contribution ) )
 	{
-		Nt.x = 1.5 * N.x; // arbitary
-		Nt.z = 1.5 * N.z; // arbitary
-		Nt.y = -( Nt.x * N.x + Nt.z * N.z ) / N.y;
+		return vec3( 0.f, 0.f, 0.f );
 	}
-	else
+
+	stats.shadowRays++;
+	return occluded( shadowRay, tmax ) ? vec3( 0.f, 0.f, 0.f ) : contribution;
+}
+
+// The light sample without its shadow ray traced: false when the sampled point cannot light the surface,
+// otherwise the shadow ray and what the sample contributes when nothing blocks it
+bool Renderer::sampleLightRay( const Hit &surface, const vec3 &BRDF, Random &rng, Ray &shadowRay, float &tmax, vec3 &contribution ) const
+{
+	if ( lights.empty() )
+	{
+		return false;
+	}
+
+	const Primitive &light = *primitives[lights[min( uint( rng.nextFloat() * lights.size() ), uint( lights.size() - 1 ) )]];
+	const vec3 origin = surface.coordinates + surface.normal * SHADOWBIAS;
+
+	float pdf;
+	const float u1 = rng.nextFloat();
+	const float u2 = rng.nextFloat();
+	const vec3 point = light.samplePoint( origin, u1, u2, pdf );
+	if ( pdf <= 0.f )
 	{
-		Nt.y = 1.5 * N.y; // arbitary
-		Nt.z = 1.5 * N.z; // arbitary
-		Nt.x = -( Nt.y * N.y + Nt.z * N.z ) / N.x;
+		return false;
 	}
-	Nt = normalize( Nt );
-	Nb = normalize( cross( N, Nt ) );
+
+	const vec3 toLight = point - origin;
+	const float distance = toLight.length();
+	const vec3 direction = toLight * ( 1.f / distance );
+	const float cos_i = dot( direction, surface.normal );
+	if ( cos_i <= 0.f )
+	{
+		return false;
+	}
+
+	pdf /= lights.size();
+	shadowRay = Ray( origin, direction );
+	tmax = distance - SHADOWBIAS;
+	contribution = BRDF * materials[light.matIdx].emission * ( cos_i * misWeight( pdf, diffusePdf( surface.normal, direction ) ) / pdf );
+	return true;
 }
 
-vec3 Renderer::shootRay( const Ray &r, unsigned depth ) const
+// Density with which sampleLight picks point, including the choice of the light
+float Renderer::lightPdf( const Primitive &light, const vec3 &from, const vec3 &point ) const
 {
-	vec3 directDiffuse = vec3( 0.f, 0.f, 0.f );
+	return light.pointPdf( from, point ) / lights.size();
+}
 
-	Hit closestHit = bvh.intersect( r );
+vec3 Renderer::shootRay( const Ray &r, unsigned depth, uint pixel ) const
+{
+	return shade( r, intersect( r ), depth, pixel );
+}
 
+vec3 Renderer::shade( const Ray &r, const Hit &closestHit, unsigned depth, uint pixel ) const
+{
 	// No hit
 	if ( closestHit.t == FLT_MAX )
 	{
 		return vec3( 0.f, 0.f, 0.f );
 	}
 
-	// Closest hit is light source
-	if ( closestHit.mat.type == EMIT_MAT ) return closestHit.mat.albedo;
+	const Material &mat = materials[closestHit.matIdx];
 
-	// Create the local coordinate system of the hit point
-	vec3 Nt, Nb;
-	createLocalCoordinateSystem( closestHit.normal, Nt, Nb );
+	// Closest hit is light source
+	if ( mat.type == EMIT_MAT ) return mat.albedo;
 
+	// Every sample is a separate path starting at the camera hit, with its own random stream
+	vec3 color = vec3( 0.f, 0.f, 0.f );
 	for ( int i = 0; i < SAMPLES; ++i )
 	{
-		// Sample the random point on unit hemisphere
-		vec3 pointOnHemi = getPointOnHemi();
+		Random rng( pixel, i + 1, currentIteration );
+		color += tracePath( r, closestHit, depth, rng );
+	}
 
-		// Transform point vector to the local coordinate system of the hit point
-		// https://www.scratchapixel.com/lessons/3d-basic-rendering/global-illumination-path-tracing/global-illumination-path-tracing-practical-implementation
-		vec3 newdir(
-			pointOnHemi.x * Nb.x + pointOnHemi.y * closestHit.normal.x + pointOnHemi.z * Nt.x,
-			pointOnHemi.x * Nb.y + pointOnHemi.y * closestHit.normal.y + pointOnHemi.z * Nt.y,
-			pointOnHemi.x * Nb.z + pointOnHemi.y * closestHit.normal.z + pointOnHemi.z * Nt.z );
+	return color * ( 1.f / SAMPLES );
+}
 
-		// Diffused ray with the calculated random direction and origin same as the hit point
-		Ray diffray;
-		diffray.direction = normalize( newdir );
-		diffray.origin = closestHit.coordinates;
+// Follows a path from a diffuse hit for at most depth hits, without recursion.
+// Every hit takes a light sample and a diffuse ray, combined with multiple importance sampling.
+vec3 Renderer::tracePath( Ray r, Hit hit, unsigned depth, Random &rng ) const
+{
+	vec3 radiance = vec3( 0.f, 0.f, 0.f );
+	vec3 throughput = vec3( 1.f, 1.f, 1.f );
+	RenderStats &stats = ThreadStats::local().stats;
+
+	for ( unsigned bounce = 0;; bounce++ )
+	{
+		const Hit surface = facingHit( hit, r.direction );
+		const vec3 BRDF = materials[surface.matIdx].albedo * ( 1 / PI );
+
+		radiance += throughput * sampleLight( surface, BRDF, rng, stats );
+
+		if ( bounce + 1 >= depth )
+		{
+			break;
+		}
+
+		float pdf;
+		const Ray diffray = diffuseRay( surface, Basis( surface.normal ), pdf, rng );
+		throughput *= BRDF * ( dot( diffray.direction, surface.normal ) / pdf );
+
+		const float survival = survivalProbability( throughput, bounce );
+		if ( rng.nextFloat() >= survival )
+		{
+			break;
+		}
+		throughput *= 1.f / survival;
 
 		// Cast the random ray and find new intersection
-		Hit newHit;
-		newHit.t = FLT_MAX;
+		stats.secondaryRays++;
+		const Intersection newHit = intersectClosest( diffray );
+
+		// No hit for the diffused ray
+		if ( newHit.primId == NO_PRIMITIVE )
+		{
+			break;
+		}
+
+		// A light ends the path, it does not reflect
+		const Primitive &newPrim = *primitives[newHit.primId];
+		const Material &newMat = materials[newPrim.matIdx];
+		if ( newMat.type == EMIT_MAT )
+		{
+			const float weight = misWeight( pdf, lightPdf( newPrim, diffray.origin, diffray( newHit.t ) ) );
+			radiance += throughput * newMat.emission * weight;
+			break;
+		}
+
+		r = diffray;
+		hit = newPrim.getHit( diffray, newHit );
+	}
+
+	return radiance;
+}
 
-		for ( Primitive *p : primitives )
+// Renders the pixels [first, last) one bounce at a time: every pass extends, shades or compacts all rays of the batch.
+// Gives the same estimate as shootRay.
+void Renderer::renderWavefront( int first, int last )
+{
+	// Every thread times its share of a pass, and stops its timer when it runs out of work instead of at the barrier
+	RenderStats &stats = ThreadStats::local().stats;
+
+	// Generate the camera rays
+	int pathCount = last - first;
+	stats.primaryRays += pathCount;
+#pragma omp parallel
+	{
+		const StageTimer shading( ThreadStats::local().stats.shadeTime );
+#pragma omp for nowait
+		for ( int i = 0; i < pathCount; i++ )
 		{
-			Hit tmp = p->hit( diffray );
-			if ( tmp.hitType != 0 )
+			const int pixel = first + i;
+			PathState &path = paths[i];
+			path.rng = Random( pixel, 0, currentIteration );
+
+			const float u[4] = {path.rng.nextFloat(), path.rng.nextFloat(), path.rng.nextFloat(), path.rng.nextFloat()};
+			const Ray r = cam.getRay( pixel % width, pixel / width, width, height, u );
+			path.origin = r.origin;
+			path.direction = r.direction;
+			path.throughput = vec3( 1.f, 1.f, 1.f );
+			path.pdf = 0.f;
+			path.pixel = pixel;
+		}
+	}
+
+	for ( unsigned depth = 0; depth < MAXRAYDEPTH && pathCount > 0; depth++ )
+	{
+		// Extend, the traversals move their time from shading to traversal
+		if ( depth > 0 )
+		{
+			stats.secondaryRays += pathCount;
+		}
+#pragma omp parallel
+		{
+			const StageTimer shading( ThreadStats::local().stats.shadeTime );
+#pragma omp for nowait
+			for ( int i = 0; i < pathCount; i++ )
 			{
-				if ( tmp.t < newHit.t )
+				pathHits[i] = intersectClosest( Ray( paths[i].origin, paths[i].direction ) );
+			}
+		}
+
+		// Shade: what a path contributes, the shadow rays of its light samples and how many rays it continues with.
+		// The camera hit starts SAMPLES paths, every later hit continues its own.
+		const int branches = depth == 0 ? SAMPLES : 1;
+#pragma omp parallel
+		{
+			const StageTimer shading( ThreadStats::local().stats.shadeTime );
+#pragma omp for nowait
+			for ( int i = 0; i < pathCount; i++ )
+			{
+				PathState &path = paths[i];
+				const Intersection &isect = pathHits[i];
+				pathContribution[i] = vec3( 0.f, 0.f, 0.f );
+				pathEmit[i] = 0;
+				pathShadows[i] = 0;
+
+				if ( isect.primId == NO_PRIMITIVE )
 				{
-					newHit = tmp;
+					continue;
+				}
+
+				const Primitive &prim = *primitives[isect.primId];
+				const Material &mat = materials[prim.matIdx];
+				const Ray r( path.origin, path.direction );
+				if ( mat.type == EMIT_MAT )
+				{
+					// Light sources show their albedo to the camera, and light the surface a diffuse ray came from
+					if ( depth == 0 )
+					{
+						pathContribution[i] = path.throughput * mat.albedo;
+					}
+					else
+					{
+						pathContribution[i] = path.throughput * mat.emission * misWeight( path.pdf, lightPdf( prim, path.origin, r( isect.t ) ) );
+					}
+				}
+				else
+				{
+					// The light samples of the hit are traced in the occlusion pass, the diffuse rays in the next extend pass.
+					// The paths that left the camera hit each carry a full throughput, their pixel gets the average
+					const Hit surface = facingHit( prim.getHit( r, isect ), r.direction );
+					const vec3 BRDF = mat.albedo * ( 1 / PI );
+					const float scale = ( 1.f / branches ) * ( depth > 0 ? 1.f / SAMPLES : 1.f );
+					for ( int j = 0; j < branches; j++ )
+					{
+						ShadowRay &shadow = shadowSlots[i * branches + pathShadows[i]];
+						Ray shadowRay;
+						vec3 contribution;
+						if ( sampleLightRay( surface, BRDF, path.rng, shadowRay, shadow.tmax, contribution ) )
+						{
+							shadow.origin = shadowRay.origin;
+							shadow.direction = shadowRay.direction;
+							shadow.contribution = path.throughput * contribution * scale;
+							shadow.pixel = path.pixel;
+							pathShadows[i]++;
+						}
+					}
+
+					if ( depth + 1 < MAXRAYDEPTH )
+					{
+						// A cosine sampled diffuse bounce scales the throughput by exactly the albedo, so Russian roulette can run before the direction is known
+						const float survival = survivalProbability( path.throughput * mat.albedo, depth );
+						for ( int j = 0; j < branches; j++ )
+						{
+							if ( path.rng.nextFloat() < survival )
+							{
+								pathEmit[i]++;
+							}
+						}
+						if ( pathEmit[i] > 0 )
+						{
+							path.throughput *= 1.f / survival;
+						}
+					}
+				}
+
+				// The paths that left the camera hit each carry a full throughput, their pixel gets the average
+				if ( depth > 0 )
+				{
+					pathContribution[i] *= 1.f / SAMPLES;
 				}
 			}
 		}
 
-		// No hit for the diffused ray
-		if ( newHit.t == FLT_MAX )
+		// Occlusion: the shadow rays of the pass, compacted and traced together
+		const int shadowCount = compactShadowRays( pathCount, branches );
+		stats.shadowRays += shadowCount;
+#pragma omp parallel
+		{
+			const StageTimer shading( ThreadStats::local().stats.shadeTime );
+#pragma omp for nowait
+			for ( int i = 0; i < shadowCount; i++ )
+			{
+				ShadowRay &shadow = shadowRays[i];
+				if ( occluded( Ray( shadow.origin, shadow.direction ), shadow.tmax ) )
+				{
+					shadow.contribution = vec3( 0.f, 0.f, 0.f );
+				}
+			}
+		}
+
+		// Several paths can belong to the same pixel, so accumulate serially.
+		// The emit counts are turned into offsets of the compacted continuation buffer at the same time.
+		int nextCount = 0;
 		{
-			return vec3( 0.f, 0.f, 0.f );
+			const StageTimer accumulating( stats.shadeTime );
+			for ( int i = 0; i < pathCount; i++ )
+			{
+				// Not accumulate(), a pixel receives several contributions per iteration so there is no variance to track
+				prebufferR[paths[i].pixel] += pathContribution[i].x;
+				prebufferG[paths[i].pixel] += pathContribution[i].y;
+				prebufferB[paths[i].pixel] += pathContribution[i].z;
+
+				const int count = pathEmit[i];
+				pathEmit[i] = nextCount;
+				nextCount += count;
+			}
+
+			for ( int i = 0; i < shadowCount; i++ )
+			{
+				const ShadowRay &shadow = shadowRays[i];
+				prebufferR[shadow.pixel] += shadow.contribution.x;
+				prebufferG[shadow.pixel] += shadow.contribution.y;
+				prebufferB[shadow.pixel] += shadow.contribution.z;
+			}
 		}
 
-		// Does diffused ray hit a light source?
-		if ( newHit.mat.type == EMIT_MAT )
+		if ( nextCount == 0 )
 		{
-			vec3 BRDF = closestHit.mat.albedo * ( 1 / PI );
-			vec3 cos_i = dot( diffray.direction, closestHit.normal );
-			directDiffuse = BRDF * newHit.mat.emission * cos_i;
+			break;
 		}
+
+		// Continuation rays, written to their compacted position
+#pragma omp parallel
+		{
+			const StageTimer shading( ThreadStats::local().stats.shadeTime );
+#pragma omp for nowait
+			for ( int i = 0; i < pathCount; i++ )
+			{
+				const int offset = pathEmit[i];
+				const int count = ( i + 1 < pathCount ? pathEmit[i + 1] : nextCount ) - offset;
+				if ( count == 0 )
+				{
+					continue;
+				}
+
+				const PathState &path = paths[i];
+				const Ray r( path.origin, path.direction );
+				const Hit hit = facingHit( primitives[pathHits[i].primId]->getHit( r, pathHits[i] ), r.direction );
+				const vec3 BRDF = materials[hit.matIdx].albedo * ( 1 / PI );
+
+				const Basis basis( hit.normal );
+
+				for ( int j = 0; j < count; j++ )
+				{
+					// The paths leaving the camera hit get the streams shade() would give them, later paths keep theirs
+					PathState &next = nextPaths[offset + j];
+					next.rng = depth == 0 ? Random( path.pixel, j + 1, currentIteration ) : path.rng;
+
+					float pdf;
+					const Ray diffray = diffuseRay( hit, basis, pdf, next.rng );
+					next.origin = diffray.origin;
+					next.direction = diffray.direction;
+					next.throughput = path.throughput * BRDF * ( dot( diffray.direction, hit.normal ) / pdf );
+					next.pdf = pdf;
+					next.pixel = path.pixel;
+				}
+			}
+		}
+
+#ifdef SORT_RAYS
+		sortPaths( nextCount );
+#else
+		swap( paths, nextPaths );
+#endif
+		pathCount = nextCount;
+	}
+}
+
+// Gathers the light samples of the shade pass from their slots into shadowRays, sorted by direction octant like the
+// continuation rays when SORT_RAYS is on. Returns how many there are
+int Renderer::compactShadowRays( int pathCount, int branches )
+{
+	const StageTimer sorting( ThreadStats::local().stats.shadeTime );
+
+#ifdef SORT_RAYS
+	int offsets[8] = {0};
+	for ( int i = 0; i < pathCount; i++ )
+	{
+		for ( int j = 0; j < pathShadows[i]; j++ )
+		{
+			offsets[octant( shadowSlots[i * branches + j].direction )]++;
+		}
+	}
+
+	int count = 0;
+	for ( int o = 0; o < 8; o++ )
+	{
+		const int size = offsets[o];
+		offsets[o] = count;
+		count += size;
+	}
+
+	for ( int i = 0; i < pathCount; i++ )
+	{
+		for ( int j = 0; j < pathShadows[i]; j++ )
+		{
+			const ShadowRay &shadow = shadowSlots[i * branches + j];
+			shadowRays[offsets[octant( shadow.direction )]++] = shadow;
+		}
+	}
+#else
+	int count = 0;
+	for ( int i = 0; i < pathCount; i++ )
+	{
+		for ( int j = 0; j < pathShadows[i]; j++ )
+		{
+			shadowRays[count++] = shadowSlots[i * branches + j];
+		}
+	}
+#endif
+
+	return count;
+}
+
+// Counting sort of nextPaths into paths by direction octant, so rays traced after each other take similar routes through the BVH
+void Renderer::sortPaths( int count )
+{
+	const StageTimer sorting( ThreadStats::local().stats.shadeTime );
+
+	int offsets[8] = {0};
+	for ( int i = 0; i < count; i++ )
+	{
+		offsets[octant( nextPaths[i].direction )]++;
 	}
 
-	return directDiffuse * 2 * ( PI / SAMPLES );
+	int sum = 0;
+	for ( int o = 0; o < 8; o++ )
+	{
+		const int size = offsets[o];
+		offsets[o] = sum;
+		sum += size;
+	}
+
+	for ( int i = 0; i < count; i++ )
+	{
+		paths[offsets[octant( nextPaths[i].direction )]++] = nextPaths[i];
+	}
 }
 
 Pixel Renderer::rgb( float r, float g, float b ) const
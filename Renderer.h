@@ -2,36 +2,164 @@
 class Renderer
 {
   public:
-	Renderer( vector<Primitive *> primitives );
+	Renderer( vector<Primitive *> primitives, vector<Material> materials, uint width = SCRWIDTH, uint height = SCRHEIGHT, uint tileSize = TILESIZE, uint threadCount = thread::hardware_concurrency() );
+	Renderer( const SceneCache &cache, uint width = SCRWIDTH, uint height = SCRHEIGHT, uint tileSize = TILESIZE, uint threadCount = thread::hardware_concurrency() ); // the cache has to stay open
 	~Renderer();
 
-	void renderFrame();
-	void setCamera( Camera cam );
+	void start();		// keeps rendering iterations on a background thread until the renderer is destroyed
+	void renderFrame(); // renders one iteration on the calling thread, only when start() was not called
+	void resize( uint width, uint height, uint tileSize ); // from the thread that calls getOutput, a running render thread is restarted
 
-	Camera *getCamera();
+	// Camera changes are queued and applied before the next iteration, which restarts accumulation
+	void setCamera( Camera cam );
+	Camera getCamera(); // as of the last applied changes
 	void moveCam( vec3 vec );
 	void rotateCam( vec3 vec );
 	void zoomCam( float deltaZoom );
 	void changeAperture( float deltaAperture );
 	void focusCam();
 
-	Pixel *getOutput() const;
+	Pixel *getOutput(); // latest completed iteration of getWidth() * getHeight() pixels, stays valid until the next call or a resize
+	float getFrameTime() const { return frameTime; }
+	bool isConverged() const { return converged; } // every tile retired, the renderer idles until the camera moves
+
+	// Accumulation stops after this many iterations, ITERATIONS unless changed before rendering starts
+	void setMaxIterations( uint iterations ) { maxIterations = iterations; }
+	uint getIterations() const { return currentIteration - 1; } // completed since the camera last changed
+	void getRadiance( float *rgb ) const; // width * height rgb triplets
+	uint getWidth() const { return width; }
+	uint getHeight() const { return height; }
+	const BVH &getBVH() const { return bvh; } // for SceneCache::write
+
+	// Work of the last completed iteration, summed over all threads
+	RenderStats getStats();
+	bool recordStats( const char *file ); // appends a CSV line per completed iteration, false if the file cannot be written. nullptr stops
 
   private:
-	vector<tuple<int, int>> tiles;
+	uint width, height;			   // of the frame in pixels
+	uint tileSize;				   // tiles are square, the ones on the right and bottom edge can be cut off
+	vector<tuple<int, int>> tiles; // in Morton order
+
+	struct TileState
+	{
+		uint iterations; // traced since the camera last changed
+		bool converged;	 // retired, only resolved from now on
+	};
+
+	vector<TileState> tileStates; // same order as tiles
+	atomic<bool> converged;
 
 	Camera cam;
 	vector<Primitive *> primitives;
+	vector<Material> materials; // indexed by Primitive::matIdx
+	vector<uint> lights;		// primitives with an emissive material, sampled for next event estimation
 	const BVH bvh;
+#ifdef USE_MBVH
+	const MBVH mbvh; // collapsed from bvh, used for traversal
+#endif
+	Scheduler scheduler; // renders the tiles, its threads live as long as the renderer
 	// vector<Light *> lights;
 
+	// Wavefront mode, one entry per ray in flight
+	struct PathState
+	{
+		vec3 origin;
+		vec3 direction;
+		vec3 throughput; // what a light source hit by this ray contributes to its path, a pixel averages SAMPLES paths
+		float pdf;		 // of the direction of a diffuse ray, for the MIS weight of the light it hits. 0 for camera rays
+		uint pixel;
+		Random rng;
+	};
+
+	vector<PathState> paths;
+	vector<PathState> nextPaths; // continuation rays of the current bounce
+	vector<Intersection> pathHits;
+	vector<vec3> pathContribution;
+	vector<int> pathEmit; // continuation rays per path, then their offset in nextPaths
+
+	// A light sample of the wavefront shade pass, traced in a separate occlusion pass
+	struct ShadowRay
+	{
+		vec3 origin;
+		vec3 direction;
+		vec3 contribution; // what reaches the pixel when nothing blocks the ray
+		float tmax;
+		uint pixel;
+	};
+
+	vector<ShadowRay> shadowSlots; // written by the shade pass, the samples of path i start at i times its branch count
+	vector<int> pathShadows;	   // light samples per path in shadowSlots
+	vector<ShadowRay> shadowRays;  // shadowSlots compacted, for the occlusion pass
+
+	static int octant( const vec3 &d ) { return ( d.x < 0.f ) | ( ( d.y < 0.f ) << 1 ) | ( ( d.z < 0.f ) << 2 ); }
+
+	// Sum of all iterations so far, one array per channel so the resolve handles MBVH_WIDTH pixels at a time
 	unsigned currentIteration;
-	vec3 *prebuffer;
-	Pixel *buffer;
+	uint maxIterations;
+	float *prebufferR, *prebufferG, *prebufferB;
+	float *prebufferLum2; // sum of the squared luminance of every iteration, for the variance
 	bool *boolbuffer; // TEST
 
+	// Camera commands from the display thread
+	mutex cameraLock;
+	vector<function<void( Camera & )>> cameraCommands;
+	atomic<bool> cameraChanged; // commands are waiting, the iteration in flight is thrown away
+
+	// Completed iterations go from the render thread to the display thread through three buffers, without locks.
+	// The render thread writes frames[backFrame], the display thread reads frames[frontFrame], and the third one is
+	// swapped with either of them. FRESH_FRAME marks it as newer than the front frame.
+	static const uint FRESH_FRAME = 4;
+	Pixel *frames[3];
+	uint backFrame;
+	uint frontFrame;
+	atomic<uint> spareFrame;
+
+	thread renderThread;
+	atomic<bool> stopRendering;
+	atomic<float> frameTime; // of the last completed iteration, in milliseconds
+
+	mutex statsLock;
+	RenderStats frameStats; // of the last completed iteration
+	FILE *statsFile;		// CSV of every completed iteration, or nullptr
+
+	void init( uint width, uint height, uint tileSize );
+	void renderLoop();
+	void freeBuffers();
+	bool applyCameraCommands();
+	void queueCameraCommand( function<void( Camera & )> command );
+	void publishFrame();
+	void publishStats( const RenderStats &stats );
+
+	Intersection intersectClosest( const Ray &r ) const; // traversal only, no shading data
+	Hit intersect( const Ray &r ) const;
+	bool occluded( const Ray &r, float tmax ) const; // visibility only, for shadow and light rays
+
 	vec3 shootRay( unsigned x, unsigned y, unsigned depth ) const;
-	vec3 shootRay( const Ray &r, unsigned depth ) const;
+	vec3 shootRay( const Ray &r, unsigned depth, uint pixel ) const;
+	void renderTile( uint tile );
+	void traceTile( int x, int y );
+	static float luminance( float r, float g, float b ) { return 0.2126f * r + 0.7152f * g + 0.0722f * b; }
+	// Adds the color of one iteration of a pixel
+	void accumulate( uint pixel, const vec3 &color )
+	{
+		const float lum = luminance( color.x, color.y, color.z );
+		prebufferR[pixel] += color.x;
+		prebufferG[pixel] += color.y;
+		prebufferB[pixel] += color.z;
+		prebufferLum2[pixel] += lum * lum;
+	}
+	float tileError( uint x, uint y, uint iterations ) const;
+	void resolve( uint first, uint count, uint iterations );
+	static uint morton( uint x, uint y );
+	void shootPacket( unsigned x, unsigned y );
+	void renderWavefront( int first, int last );
+	void sortPaths( int count );
+	int compactShadowRays( int pathCount, int branches );
+	vec3 shade( const Ray &r, const Hit &closestHit, unsigned depth, uint pixel ) const;
+	vec3 tracePath( Ray r, Hit hit, unsigned depth, Random &rng ) const;
+	vec3 sampleLight( const Hit &surface, const vec3 &BRDF, Random &rng, RenderStats &stats ) const;
+	bool sampleLightRay( const Hit &surface, const vec3 &BRDF, Random &rng, Ray &shadowRay, float &tmax, vec3 &contribution ) const;
+	float lightPdf( const Primitive &light, const vec3 &from, const vec3 &point ) const;
 
 	void invalidatePrebuffer();
 
@@ -1,26 +1,30 @@
 #include "precomp.h"
 
 // From: http://www.rorydriscoll.com/2009/01/07/better-sampling/
-// Actually does not work!
-vec3 Sample::cosineSampleHemisphere( const float &u1, const float &u2 )
+// Uniform on the unit disk, projected up onto the hemisphere
+vec3 Sample::cosineSampleHemisphere( float u1, float u2, float &pdf )
 {
 	const float r = sqrt( u1 );
 	const float theta = 2 * PI * u2;
 
 	const float x = r * cos( theta );
 	const float y = r * sin( theta );
+	const float z = sqrt( std::max( 0.f, 1 - u1 ) );
 
-	return vec3( x, y, sqrt( std::max( 0.f, 1 - u1 ) ) );
+	pdf = cosineHemispherePdf( z );
+	return vec3( x, y, z );
 }
 
 // From: Scratchapixel
-vec3 Sample::uniformSampleHemisphere( const float &r1, const float &r2 )
+vec3 Sample::uniformSampleHemisphere( float u1, float u2, float &pdf )
 {
-	// cos(theta) = r1 = y
+	// cos(theta) = u1 = z
 	// cos^2(theta) + sin^2(theta) = 1 -> sin(theta) = srtf(1 - cos^2(theta))
-	float sinTheta = sqrtf( 1 - r1 * r1 );
-	float phi = 2 * M_PI * r2;
+	float sinTheta = sqrtf( 1 - u1 * u1 );
+	float phi = 2 * PI * u2;
 	float x = sinTheta * cosf( phi );
-	float z = sinTheta * sinf( phi );
-	return vec3( x, r1, z );
-}
\ No newline at end of file
+	float y = sinTheta * sinf( phi );
+
+	pdf = uniformHemispherePdf();
+	return vec3( x, y, u1 );
+}
@@ -1,11 +1,33 @@
 #pragma once
 
+// Orthonormal basis around a unit normal, so directions sampled around z can be turned into world space.
+// Branchless construction from Duff et al. 2017, "Building an Orthonormal Basis, Revisited"
+struct Basis
+{
+	vec3 tangent;
+	vec3 bitangent;
+	vec3 normal;
+
+	Basis( const vec3 &n ) : normal( n )
+	{
+		const float sign = copysignf( 1.f, n.z );
+		const float a = -1.f / ( sign + n.z );
+		const float b = n.x * n.y * a;
+		tangent = vec3( 1.f + sign * n.x * n.x * a, sign * b, -sign * n.x );
+		bitangent = vec3( b, sign + n.y * n.y * a, -n.y );
+	}
+
+	vec3 toWorld( const vec3 &local ) const { return tangent * local.x + bitangent * local.y + normal * local.z; }
+};
+
 // https : //stackoverflow.com/questions/19665818/generate-random-numbers-using-c11-random-library
+// Directions on the hemisphere around z, from two uniform numbers in [0, 1). pdf is per unit solid angle.
 class Sample
 {
   public:
+	static vec3 uniformSampleHemisphere( float u1, float u2, float &pdf );
+	static vec3 cosineSampleHemisphere( float u1, float u2, float &pdf );
 
-	 // Sample();
-	vec3 uniformSampleHemisphere(const float &r1, const float &r2 );
-	vec3 cosineSampleHemisphere( const float &r1, const float &r2 );
-};
\ No newline at end of file
+	static float uniformHemispherePdf() { return 1.f / ( 2.f * PI ); }
+	static float cosineHemispherePdf( float cosTheta ) { return max( 0.f, cosTheta ) / PI; }
+};
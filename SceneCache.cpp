@@ -0,0 +1,486 @@
+#include "precomp.h"
+
+// Bumped whenever the layout below changes, older files are rebuilt
+static const uint CACHE_VERSION = 1;
+static const char CACHE_MAGIC[8] = {'T', 'M', 'P', 'L', 'S', 'C', 'N', 0};
+
+// Every array starts on a cache line, the node array needs at least the alignment of BVHNode
+static const uint64_t CACHE_ALIGNMENT = 64;
+
+struct SceneCache::Header
+{
+	char magic[8];
+	uint version;
+	uint binCount, bvhDepth; // build parameters of the tree
+	uint nodeSize;			 // sizeof( BVHNode ), compilers may lay out its bit fields differently
+	uint64_t key;
+	uint64_t fileSize;
+	uint materialCount, sphereCount, vertexCount, triangleCount, primitiveCount, nodeCount;
+	uint64_t materialOffset, sphereOffset, vertexOffset, triangleOffset, primitiveOffset, nodeOffset, primIndexOffset;
+};
+
+// The records only hold 4 byte fields, so they have no padding and can be hashed as they are
+struct CachedMaterial
+{
+	uint type;
+	float albedo[3];
+	float emission[3];
+};
+
+struct CachedSphere
+{
+	float center[3];
+	float radius;
+	uint matIdx;
+};
+
+struct CachedVertex
+{
+	float position[3];
+	float uv[2];
+};
+
+struct CachedTriangle
+{
+	uint v[3];
+	uint matIdx;
+};
+
+// A primitive is an index into the spheres when this bit is set, into the triangles otherwise
+static const uint SPHERE_BIT = 0x80000000u;
+
+struct FlatScene
+{
+	vector<CachedMaterial> materials;
+	vector<CachedSphere> spheres;
+	vector<CachedVertex> vertices;
+	vector<CachedTriangle> triangles;
+	vector<uint> primitives;
+};
+
+// False when the scene holds a primitive the cache cannot store
+static bool flatten( const vector<Primitive *> &primitives, const vector<Material> &materials, FlatScene &flat )
+{
+	for ( const Material &material : materials )
+	{
+		flat.materials.push_back( {uint( material.type ), {material.albedo.x, material.albedo.y, material.albedo.z}, {material.emission.x, material.emission.y, material.emission.z}} );
+	}
+
+	for ( const Primitive *primitive : primitives )
+	{
+		if ( const Sphere *sphere = dynamic_cast<const Sphere *>( primitive ) )
+		{
+			flat.primitives.push_back( uint( flat.spheres.size() ) | SPHERE_BIT );
+			flat.spheres.push_back( {{sphere->origin.x, sphere->origin.y, sphere->origin.z}, sphere->radius, sphere->matIdx} );
+		}
+		else if ( const Triangle *triangle = dynamic_cast<const Triangle *>( primitive ) )
+		{
+			const uint first = flat.vertices.size();
+			flat.primitives.push_back( uint( flat.triangles.size() ) );
+			flat.triangles.push_back( {{first, first + 1, first + 2}, triangle->matIdx} );
+			flat.vertices.push_back( {{triangle->v0.x, triangle->v0.y, triangle->v0.z}, {triangle->uv0.x, triangle->uv0.y}} );
+			flat.vertices.push_back( {{triangle->v1.x, triangle->v1.y, triangle->v1.z}, {triangle->uv1.x, triangle->uv1.y}} );
+			flat.vertices.push_back( {{triangle->v2.x, triangle->v2.y, triangle->v2.z}, {triangle->uv2.x, triangle->uv2.y}} );
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static uint64_t alignOffset( uint64_t offset )
+{
+	return ( offset + CACHE_ALIGNMENT - 1 ) & ~( CACHE_ALIGNMENT - 1 );
+}
+
+// Appends count elements at the next aligned offset and returns where they went
+static uint64_t writeArray( FILE *file, uint64_t &offset, const void *elements, size_t elementSize, size_t count )
+{
+	static const char padding[CACHE_ALIGNMENT] = {0};
+	const uint64_t start = alignOffset( offset );
+	fwrite( padding, 1, start - offset, file );
+	fwrite( elements, elementSize, count, file );
+	offset = start + elementSize * count;
+	return start;
+}
+
+bool SceneCache::write( const char *file, uint64_t key, const BVH &bvh, const vector<Material> &materials )
+{
+	FlatScene flat;
+	if ( !flatten( bvh.getPrimitives(), materials, flat ) )
+	{
+		return false;
+	}
+
+	// Written under a name of this process in the same directory and renamed over the cache at the end, so another job never
+	// maps a half-written file and a crash leaves the old cache or none
+#ifdef _WIN32
+	const string temp = string( file ) + "." + to_string( GetCurrentProcessId() ) + ".tmp";
+#else
+	const string temp = string( file ) + "." + to_string( getpid() ) + ".tmp";
+#endif
+	FILE *out = fopen( temp.c_str(), "wb" );
+	if ( !out )
+	{
+		return false;
+	}
+
+	Header header;
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, CACHE_MAGIC, sizeof( CACHE_MAGIC ) );
+	header.version = CACHE_VERSION;
+	header.binCount = BINCOUNT;
+	header.bvhDepth = BVHDEPTH;
+	header.nodeSize = sizeof( BVHNode );
+	header.key = key;
+	header.materialCount = flat.materials.size();
+	header.sphereCount = flat.spheres.size();
+	header.vertexCount = flat.vertices.size();
+	header.triangleCount = flat.triangles.size();
+	header.primitiveCount = flat.primitives.size();
+	header.nodeCount = bvh.getNodeCount();
+
+	// A placeholder header first, the real one once the offsets are known
+	fwrite( &header, sizeof( header ), 1, out );
+	uint64_t offset = sizeof( Header );
+	header.materialOffset = writeArray( out, offset, flat.materials.data(), sizeof( CachedMaterial ), flat.materials.size() );
+	header.sphereOffset = writeArray( out, offset, flat.spheres.data(), sizeof( CachedSphere ), flat.spheres.size() );
+	header.vertexOffset = writeArray( out, offset, flat.vertices.data(), sizeof( CachedVertex ), flat.vertices.size() );
+	header.triangleOffset = writeArray( out, offset, flat.triangles.data(), sizeof( CachedTriangle ), flat.triangles.size() );
+	header.primitiveOffset = writeArray( out, offset, flat.primitives.data(), sizeof( uint ), flat.primitives.size() );
+	header.nodeOffset = writeArray( out, offset, bvh.getNodes(), sizeof( BVHNode ), bvh.getNodeCount() );
+	header.primIndexOffset = writeArray( out, offset, bvh.getPrimIndices(), sizeof( uint ), flat.primitives.size() );
+	header.fileSize = offset;
+
+	fseek( out, 0, SEEK_SET );
+	fwrite( &header, sizeof( header ), 1, out );
+	const bool written = !ferror( out );
+	if ( fclose( out ) != 0 || !written )
+	{
+		remove( temp.c_str() );
+		return false;
+	}
+
+#ifdef _WIN32
+	// rename does not replace an existing file on Windows
+	const bool renamed = MoveFileExA( temp.c_str(), file, MOVEFILE_REPLACE_EXISTING ) != 0;
+#else
+	const bool renamed = rename( temp.c_str(), file ) == 0;
+#endif
+	if ( !renamed )
+	{
+		remove( temp.c_str() );
+	}
+	return renamed;
+}
+
+bool SceneCache::open( const char *fileName, uint64_t key )
+{
+	close();
+
+#ifdef _WIN32
+	file = CreateFileA( fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+	if ( file == INVALID_HANDLE_VALUE )
+	{
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx( file, &fileSize );
+	mapping = fileSize.QuadPart >= (LONGLONG)sizeof( Header ) ? CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr ) : nullptr;
+	if ( !mapping )
+	{
+		CloseHandle( file );
+		return false;
+	}
+
+	data = (const char *)MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+	if ( !data )
+	{
+		CloseHandle( mapping );
+		CloseHandle( file );
+		return false;
+	}
+	size = size_t( fileSize.QuadPart );
+#else
+	const int fd = ::open( fileName, O_RDONLY );
+	if ( fd < 0 )
+	{
+		return false;
+	}
+
+	struct stat status;
+	if ( fstat( fd, &status ) != 0 || status.st_size < (off_t)sizeof( Header ) )
+	{
+		::close( fd );
+		return false;
+	}
+
+	// The mapping keeps its own reference to the file
+	void *mapped = mmap( nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	::close( fd );
+	if ( mapped == MAP_FAILED )
+	{
+		return false;
+	}
+	data = (const char *)mapped;
+	size = status.st_size;
+#endif
+
+	const Header &h = header();
+	auto fits = [this]( uint64_t offset, uint count, size_t elementSize ) { return offset % CACHE_ALIGNMENT == 0 && offset <= size && count <= ( size - offset ) / elementSize; };
+	const bool valid = memcmp( h.magic, CACHE_MAGIC, sizeof( CACHE_MAGIC ) ) == 0 && h.version == CACHE_VERSION && h.binCount == BINCOUNT &&
+					   h.bvhDepth == BVHDEPTH && h.nodeSize == sizeof( BVHNode ) && h.key == key && h.fileSize == size &&
+					   fits( h.materialOffset, h.materialCount, sizeof( CachedMaterial ) ) && fits( h.sphereOffset, h.sphereCount, sizeof( CachedSphere ) ) &&
+					   fits( h.vertexOffset, h.vertexCount, sizeof( CachedVertex ) ) && fits( h.triangleOffset, h.triangleCount, sizeof( CachedTriangle ) ) &&
+					   fits( h.primitiveOffset, h.primitiveCount, sizeof( uint ) ) && fits( h.nodeOffset, h.nodeCount, sizeof( BVHNode ) ) &&
+					   fits( h.primIndexOffset, h.primitiveCount, sizeof( uint ) ) && contentsValid();
+	if ( !valid )
+	{
+		close();
+	}
+	return valid;
+}
+
+// The arrays are used as they are, so every index in them is checked once against the array it points into.
+// A damaged file that still has the right size would otherwise send traversal or createPrimitives out of bounds
+bool SceneCache::contentsValid() const
+{
+	const Header &h = header();
+	const CachedMaterial *materials = (const CachedMaterial *)( data + h.materialOffset );
+	const CachedSphere *spheres = (const CachedSphere *)( data + h.sphereOffset );
+	const CachedTriangle *triangles = (const CachedTriangle *)( data + h.triangleOffset );
+	const uint *records = (const uint *)( data + h.primitiveOffset );
+	const BVHNode *nodes = (const BVHNode *)( data + h.nodeOffset );
+	const uint *primIndices = (const uint *)( data + h.primIndexOffset );
+
+	for ( uint i = 0; i < h.materialCount; i++ )
+	{
+		if ( materials[i].type > EMIT_MAT )
+		{
+			return false;
+		}
+	}
+
+	for ( uint i = 0; i < h.sphereCount; i++ )
+	{
+		if ( spheres[i].matIdx >= h.materialCount )
+		{
+			return false;
+		}
+	}
+
+	for ( uint i = 0; i < h.triangleCount; i++ )
+	{
+		const CachedTriangle &t = triangles[i];
+		if ( t.matIdx >= h.materialCount || t.v[0] >= h.vertexCount || t.v[1] >= h.vertexCount || t.v[2] >= h.vertexCount )
+		{
+			return false;
+		}
+	}
+
+	for ( uint i = 0; i < h.primitiveCount; i++ )
+	{
+		const uint index = records[i] & ~SPHERE_BIT;
+		if ( index >= ( records[i] & SPHERE_BIT ? h.sphereCount : h.triangleCount ) || primIndices[i] >= h.primitiveCount )
+		{
+			return false;
+		}
+	}
+
+	// Traversal starts at the root of any scene with primitives
+	if ( h.primitiveCount > 0 && h.nodeCount == 0 )
+	{
+		return false;
+	}
+
+	// Children come after their parent, so one pass in array order sees every parent before its children and there are no cycles.
+	// Interior nodes deeper than the build allows would overflow the traversal stacks.
+	// Every node but the root must have exactly one parent, shared subtrees would let a small file describe an exponential traversal
+	vector<uint> depth( h.nodeCount, 0 );
+	vector<uint> parents( h.nodeCount, 0 );
+	for ( uint i = 0; i < h.nodeCount; i++ )
+	{
+		const BVHNode &node = nodes[i];
+		if ( node.isLeaf() )
+		{
+			if ( uint64_t( node.leftFirst ) + node.count > h.primitiveCount )
+			{
+				return false;
+			}
+			continue;
+		}
+
+		const uint left = node.left( i );
+		const uint right = node.right();
+		if ( node.axis > 2 || depth[i] >= BVHDEPTH || left >= h.nodeCount || right <= left || right >= h.nodeCount )
+		{
+			return false;
+		}
+		depth[left] = depth[i] + 1;
+		depth[right] = depth[i] + 1;
+		parents[left]++;
+		parents[right]++;
+	}
+
+	for ( uint i = 0; i < h.nodeCount; i++ )
+	{
+		if ( parents[i] != ( i == 0 ? 0u : 1u ) )
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void SceneCache::close()
+{
+	if ( !data )
+	{
+		return;
+	}
+
+#ifdef _WIN32
+	UnmapViewOfFile( data );
+	CloseHandle( mapping );
+	CloseHandle( file );
+#else
+	munmap( (void *)data, size );
+#endif
+	data = nullptr;
+	size = 0;
+}
+
+vector<Primitive *> SceneCache::createPrimitives() const
+{
+	const Header &h = header();
+	const CachedSphere *spheres = (const CachedSphere *)( data + h.sphereOffset );
+	const CachedVertex *vertices = (const CachedVertex *)( data + h.vertexOffset );
+	const CachedTriangle *triangles = (const CachedTriangle *)( data + h.triangleOffset );
+	const uint *records = (const uint *)( data + h.primitiveOffset );
+
+	vector<Primitive *> primitives( h.primitiveCount );
+	for ( uint i = 0; i < h.primitiveCount; i++ )
+	{
+		if ( records[i] & SPHERE_BIT )
+		{
+			const CachedSphere &s = spheres[records[i] & ~SPHERE_BIT];
+			primitives[i] = new Sphere( vec3( s.center[0], s.center[1], s.center[2] ), s.radius, s.matIdx );
+		}
+		else
+		{
+			const CachedTriangle &t = triangles[records[i]];
+			vec3 verts[3];
+			vec2 uv[3];
+			for ( int j = 0; j < 3; j++ )
+			{
+				const CachedVertex &v = vertices[t.v[j]];
+				verts[j] = vec3( v.position[0], v.position[1], v.position[2] );
+				uv[j] = vec2( v.uv[0], v.uv[1] );
+			}
+			primitives[i] = new Triangle( t.matIdx, verts, uv );
+		}
+	}
+
+	return primitives;
+}
+
+vector<Material> SceneCache::getMaterials() const
+{
+	const Header &h = header();
+	const CachedMaterial *cached = (const CachedMaterial *)( data + h.materialOffset );
+
+	vector<Material> materials( h.materialCount );
+	for ( uint i = 0; i < h.materialCount; i++ )
+	{
+		materials[i].type = MaterialType( cached[i].type );
+		materials[i].albedo = vec3( cached[i].albedo[0], cached[i].albedo[1], cached[i].albedo[2] );
+		materials[i].emission = vec3( cached[i].emission[0], cached[i].emission[1], cached[i].emission[2] );
+	}
+
+	return materials;
+}
+
+const SceneCache::Header &SceneCache::header() const
+{
+	return *(const Header *)data;
+}
+
+const BVHNode *SceneCache::getNodes() const
+{
+	return (const BVHNode *)( data + header().nodeOffset );
+}
+
+uint SceneCache::getNodeCount() const
+{
+	return header().nodeCount;
+}
+
+const uint *SceneCache::getPrimIndices() const
+{
+	return (const uint *)( data + header().primIndexOffset );
+}
+
+// Multiply-rotate over 8 bytes at a time, fast enough to hash a large model on every launch. Not meant to resist tampering
+uint64_t SceneCache::hash( const void *bytes, size_t count, uint64_t seed )
+{
+	const unsigned char *p = (const unsigned char *)bytes;
+	uint64_t h = seed ^ ( count * 0x9E3779B97F4A7C15ull );
+
+	size_t i = 0;
+	for ( ; i + 8 <= count; i += 8 )
+	{
+		uint64_t word;
+		memcpy( &word, p + i, 8 );
+		h ^= word * 0xFF51AFD7ED558CCDull;
+		h = ( ( h << 31 ) | ( h >> 33 ) ) * 0x9E3779B97F4A7C15ull;
+	}
+
+	for ( ; i < count; i++ )
+	{
+		h ^= p[i] * 0xFF51AFD7ED558CCDull;
+		h = ( ( h << 31 ) | ( h >> 33 ) ) * 0x9E3779B97F4A7C15ull;
+	}
+
+	// Final avalanche of MurmurHash3
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+uint64_t SceneCache::hashFile( const char *file, uint64_t seed )
+{
+	FILE *in = fopen( file, "rb" );
+	if ( !in )
+	{
+		return seed;
+	}
+
+	vector<char> buffer( 1 << 20 );
+	uint64_t h = seed;
+	size_t count;
+	while ( ( count = fread( buffer.data(), 1, buffer.size(), in ) ) > 0 )
+	{
+		h = hash( buffer.data(), count, h );
+	}
+
+	fclose( in );
+	return h;
+}
+
+uint64_t SceneCache::hashScene( const vector<Primitive *> &primitives, const vector<Material> &materials )
+{
+	FlatScene flat;
+	flatten( primitives, materials, flat );
+
+	uint64_t h = hash( flat.materials.data(), flat.materials.size() * sizeof( CachedMaterial ), 0 );
+	h = hash( flat.spheres.data(), flat.spheres.size() * sizeof( CachedSphere ), h );
+	h = hash( flat.vertices.data(), flat.vertices.size() * sizeof( CachedVertex ), h );
+	h = hash( flat.triangles.data(), flat.triangles.size() * sizeof( CachedTriangle ), h );
+	return hash( flat.primitives.data(), flat.primitives.size() * sizeof( uint ), h );
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+// Binary scene file with the primitives, materials and finished BVH of a scene, so a model is not parsed and its tree not
+// built again on every launch. Written after the first build, memory-mapped read-only afterwards.
+// The BVH arrays are used in place, so a cache has to stay open for as long as a renderer uses it.
+class SceneCache
+{
+  public:
+	SceneCache() : data( nullptr ), size( 0 ) {}
+	~SceneCache() { close(); }
+
+	SceneCache( const SceneCache & ) = delete;
+	SceneCache &operator=( const SceneCache & ) = delete;
+
+	// False when the file is missing, damaged, from another format version or BVH build parameters, or made for another key
+	bool open( const char *file, uint64_t key );
+	void close();
+
+	// New primitives in the order the tree refers to them, for a Renderer to take over
+	vector<Primitive *> createPrimitives() const;
+	vector<Material> getMaterials() const;
+	const BVHNode *getNodes() const;
+	uint getNodeCount() const;
+	const uint *getPrimIndices() const;
+
+	// Spheres and triangles only, the tree and its primitives as bvh holds them
+	static bool write( const char *file, uint64_t key, const BVH &bvh, const vector<Material> &materials );
+
+	// Keys: the source file, seeded with whatever else the scene is made of
+	static uint64_t hash( const void *bytes, size_t count, uint64_t seed );
+	static uint64_t hashFile( const char *file, uint64_t seed );
+	static uint64_t hashScene( const vector<Primitive *> &primitives, const vector<Material> &materials );
+
+  private:
+	const char *data; // the mapped file
+	size_t size;
+#ifdef _WIN32
+	HANDLE file, mapping;
+#endif
+
+	struct Header;
+	const Header &header() const;
+	bool contentsValid() const; // every index in the mapped arrays is in range
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+// Runs batches of independent tasks on threads that stay alive between batches.
+// Every thread owns a deque of task indices, works through it from the front and steals from the back of the others once it runs dry.
+// The calling thread takes part as worker 0.
+class Scheduler
+{
+  public:
+	Scheduler( uint threadCount ) : workers( max( 1u, threadCount ) ), job( nullptr ), remaining( 0 ), generation( 0 ), quit( false )
+	{
+		for ( uint i = 1; i < workers.size(); i++ )
+		{
+			threads.push_back( thread( &Scheduler::workerLoop, this, i ) );
+		}
+	}
+
+	Scheduler( const Scheduler & ) = delete;
+	Scheduler &operator=( const Scheduler & ) = delete;
+
+	~Scheduler()
+	{
+		{
+			lock_guard<mutex> lock( stateLock );
+			quit = true;
+		}
+		wake.notify_all();
+
+		for ( thread &t : threads )
+		{
+			t.join();
+		}
+	}
+
+	// Calls task( i ) for every i in [0, count) and returns once all of them are done.
+	// Each worker starts on its own contiguous range, so neighbouring tasks stay on one thread until it has to steal.
+	void run( uint count, const function<void( uint )> &task )
+	{
+		if ( count == 0 )
+		{
+			return;
+		}
+
+		job = &task;
+		remaining = count;
+
+		const uint workerCount = workers.size();
+		for ( uint w = 0; w < workerCount; w++ )
+		{
+			lock_guard<mutex> lock( workers[w].lock );
+			for ( uint i = count * w / workerCount; i < count * ( w + 1 ) / workerCount; i++ )
+			{
+				workers[w].tasks.push_back( i );
+			}
+		}
+
+		{
+			lock_guard<mutex> lock( stateLock );
+			generation++;
+		}
+		wake.notify_all();
+
+		work( 0 );
+
+		unique_lock<mutex> lock( stateLock );
+		done.wait( lock, [this] { return remaining == 0; } );
+	}
+
+	uint getThreadCount() const { return workers.size(); }
+
+  private:
+	struct Worker
+	{
+		mutex lock;
+		deque<uint> tasks;
+	};
+
+	vector<Worker> workers;
+	vector<thread> threads;
+
+	const function<void( uint )> *job;
+	atomic<uint> remaining; // tasks of the current batch that have not finished yet
+
+	mutex stateLock;
+	condition_variable wake; // a new batch was started, or the scheduler shuts down
+	condition_variable done; // the last task of a batch finished
+	uint generation;		 // batches started so far
+	bool quit;
+
+	void workerLoop( uint w )
+	{
+		uint seen = 0;
+
+		while ( true )
+		{
+			{
+				unique_lock<mutex> lock( stateLock );
+				wake.wait( lock, [&] { return quit || generation != seen; } );
+				if ( quit )
+				{
+					return;
+				}
+				seen = generation;
+			}
+
+			work( w );
+		}
+	}
+
+	// Tasks never spawn new tasks, so once every deque is empty this worker is done with the batch
+	void work( uint w )
+	{
+		uint task;
+		while ( pop( w, task ) || steal( w, task ) )
+		{
+			( *job )( task );
+
+			if ( --remaining == 0 )
+			{
+				lock_guard<mutex> lock( stateLock );
+				done.notify_all();
+			}
+		}
+	}
+
+	bool pop( uint w, uint &task )
+	{
+		Worker &worker = workers[w];
+		lock_guard<mutex> lock( worker.lock );
+
+		if ( worker.tasks.empty() )
+		{
+			return false;
+		}
+
+		task = worker.tasks.front();
+		worker.tasks.pop_front();
+		return true;
+	}
+
+	// Takes from the end of the victim's range, furthest away from what it is working on
+	bool steal( uint w, uint &task )
+	{
+		for ( uint i = 1; i < workers.size(); i++ )
+		{
+			Worker &victim = workers[( w + i ) % workers.size()];
+			lock_guard<mutex> lock( victim.lock );
+
+			if ( !victim.tasks.empty() )
+			{
+				task = victim.tasks.back();
+				victim.tasks.pop_back();
+				return true;
+			}
+		}
+
+		return false;
+	}
+};
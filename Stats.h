@@ -0,0 +1,173 @@
+#pragma once
+
+// What the renderer did during one iteration, to tell whether time goes to the BVH, the integrator or the resolve.
+// Every thread counts into its own copy without atomics, the copies are summed once per iteration.
+// Times are in milliseconds summed over all threads, so they add up to the frame time times the thread count.
+struct RenderStats
+{
+	uint64_t primaryRays = 0;	 // camera rays
+	uint64_t secondaryRays = 0;	 // diffuse bounces
+	uint64_t shadowRays = 0;	 // visibility tests towards a light sample
+	uint64_t nodesVisited = 0;	 // BVH nodes fetched, a packet fetches a node once for all of its rays
+	uint64_t primitiveTests = 0; // ray-primitive tests, a triangle block counts all of its lanes
+	double traverseTime = 0.0;	 // in the BVH, estimated from a sample of the traversals. Only with TRAVERSAL_TIMING
+	double shadeTime = 0.0;		 // everything else tracing does: ray generation, sampling, materials, accumulation. And traversal without TRAVERSAL_TIMING
+	double resolveTime = 0.0;	 // accumulated colors to frame pixels
+
+	uint64_t rays() const { return primaryRays + secondaryRays + shadowRays; }
+
+	RenderStats &operator+=( const RenderStats &other )
+	{
+		primaryRays += other.primaryRays;
+		secondaryRays += other.secondaryRays;
+		shadowRays += other.shadowRays;
+		nodesVisited += other.nodesVisited;
+		primitiveTests += other.primitiveTests;
+		traverseTime += other.traverseTime;
+		shadeTime += other.shadeTime;
+		resolveTime += other.resolveTime;
+		return *this;
+	}
+
+	// One line per iteration, the columns of writeCsv
+	static const char *csvHeader() { return "primary_rays,secondary_rays,shadow_rays,nodes_visited,primitive_tests,traverse_ms,shade_ms,resolve_ms"; }
+
+	void writeCsv( FILE *file ) const
+	{
+		fprintf( file, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.3f,%.3f,%.3f", primaryRays, secondaryRays, shadowRays, nodesVisited, primitiveTests, traverseTime, shadeTime, resolveTime );
+	}
+};
+
+// The counters of the calling thread. Threads register themselves on first use, so collect can sum them without their help.
+class ThreadStats
+{
+  public:
+	RenderStats stats;
+
+	static ThreadStats &local()
+	{
+		thread_local ThreadStats threadStats;
+		return threadStats;
+	}
+
+	// Sum of all threads since the last call, after which they start over. Only while no thread is rendering
+	static RenderStats collect()
+	{
+		Registry &registry = getRegistry();
+		lock_guard<mutex> lock( registry.lock );
+
+		RenderStats total = registry.retired;
+		registry.retired = RenderStats();
+		for ( ThreadStats *other : registry.threads )
+		{
+			total += other->stats;
+			other->stats = RenderStats();
+		}
+		return total;
+	}
+
+	// Picks one in STATS_TIMING_INTERVAL traversals at random to be timed
+	bool sample()
+	{
+		sampler ^= sampler << 13;
+		sampler ^= sampler >> 17;
+		sampler ^= sampler << 5;
+		return sampler % STATS_TIMING_INTERVAL == 0;
+	}
+
+  private:
+	uint sampler; // xorshift32 state
+
+	struct Registry
+	{
+		mutex lock;
+		vector<ThreadStats *> threads;
+		RenderStats retired; // of threads that ended since the last collect
+	};
+
+	static Registry &getRegistry()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	ThreadStats()
+	{
+		Registry &registry = getRegistry();
+		lock_guard<mutex> lock( registry.lock );
+		registry.threads.push_back( this );
+		sampler = 0x9E3779B9u * uint( registry.threads.size() );
+	}
+
+	~ThreadStats()
+	{
+		Registry &registry = getRegistry();
+		lock_guard<mutex> lock( registry.lock );
+		registry.retired += stats;
+		registry.threads.erase( find( registry.threads.begin(), registry.threads.end(), this ) );
+	}
+};
+
+// Adds the time until it goes out of scope to a total in milliseconds.
+// timer rounds to whole microseconds, too coarse for a single traversal.
+class StageTimer
+{
+  public:
+	StageTimer( double &total ) : total( total ), start( timer::get() ) {}
+	~StageTimer() { total += chrono::duration<double, milli>( timer::get() - start ).count(); }
+
+  private:
+	double &total;
+	timer::TimePoint start;
+};
+
+#ifdef TRAVERSAL_TIMING
+// Times a sample of the traversals, reading the clock around every one of them would cost about as much as a short traversal.
+// A timed traversal counts STATS_TIMING_INTERVAL times and moves that time from shading to traversal.
+class TraversalTimer
+{
+  public:
+	TraversalTimer() : threadStats( ThreadStats::local() ), timed( threadStats.sample() )
+	{
+		if ( timed )
+		{
+			start = timer::get();
+		}
+	}
+
+	~TraversalTimer()
+	{
+		if ( timed )
+		{
+			const double time = chrono::duration<double, milli>( timer::get() - start ).count() * STATS_TIMING_INTERVAL;
+			threadStats.stats.traverseTime += time;
+			threadStats.stats.shadeTime -= time;
+		}
+	}
+
+  private:
+	ThreadStats &threadStats;
+	bool timed;
+	timer::TimePoint start;
+};
+#else
+// Without TRAVERSAL_TIMING traversals are not timed, their time goes to shading
+struct TraversalTimer
+{
+	TraversalTimer() {}
+};
+#endif
+
+// Counts the work of one traversal in registers, and adds it to the thread's stats once when it goes out of scope
+struct TraversalCounter
+{
+	uint nodes = 0;
+	uint tests = 0;
+
+	~TraversalCounter()
+	{
+		RenderStats &stats = ThreadStats::local().stats;
+		stats.nodesVisited += nodes;
+		stats.primitiveTests += tests;
+	}
+};
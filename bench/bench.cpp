@@ -0,0 +1,542 @@
+#include "precomp.h"
+
+// Benchmark suite over a fixed set of scenes, to track performance per commit.
+// Every scene is rendered from fixed cameras, and every random number comes from a fixed seed, so two runs trace the same rays.
+// For each scene it times the BVH build, batches of primary, diffuse and shadow rays through the traversal, and full frames
+// of the renderer. The results go to stdout as JSON, progress to stderr.
+//
+//   bench [--scene name] [--width w] [--height h] [--frames n] [--threads n] [--json file] [--label text]
+//
+// --label is copied into the JSON, to tag a run with a commit for example.
+// traverse_ms is only measured in builds with TRAVERSAL_TIMING defined, otherwise it is null and shade_ms includes traversal.
+// Exits with 1 when a scene is missing, or when the renderer is not clearly faster than a linear scan on a large scene.
+
+#ifndef BENCH_ASSETS
+#define BENCH_ASSETS "assets/obj"
+#endif
+
+#define BENCH_FRAMES 4
+#define BENCH_RAYS 65536 // per batch
+#define BENCH_BATCH_RUNS 3 // a batch is traced this many times, the fastest run counts
+#define BENCH_LINEAR_RAYS 256 // the linear scan is slow on large scenes, so it gets fewer rays
+#define BENCH_MIN_SPEEDUP 2.f
+#define BENCH_CHECK_PRIMITIVES 512 // smaller scenes are not expected to beat a linear scan
+#define BENCH_SEED 2018
+
+struct Options
+{
+	string scene; // all of them when empty
+	uint width = SCRWIDTH;
+	uint height = SCRHEIGHT;
+	uint frames = BENCH_FRAMES;
+	uint threads = max( 1u, thread::hardware_concurrency() );
+	string json;
+	string label;
+};
+
+struct BenchCamera
+{
+	const char *name;
+	vec3 origin;
+	vec3 target;
+};
+
+struct BenchScene
+{
+	const char *name;
+	function<bool( vector<Primitive *> &, uint )> create; // adds the model with the given material, false if it cannot be loaded
+	vector<BenchCamera> cameras;
+};
+
+// Ray batch timings of one camera, in millions of rays per second on a single thread
+struct BatchResult
+{
+	uint primaryRays, diffuseRays, shadowRays;
+	double primary, diffuse, shadow;
+	float linearPerRay; // microseconds
+};
+
+struct FrameResult
+{
+	double frameTime; // milliseconds, average over the timed frames
+	RenderStats stats; // summed over the timed frames
+	float speedup;	   // over the linear estimate
+};
+
+static void printUsage()
+{
+	fprintf( stderr, "usage: bench [--scene name] [--width w] [--height h] [--frames n] [--threads n] [--json file] [--label text]\n" );
+	fprintf( stderr, "traverse_ms needs a build with TRAVERSAL_TIMING defined in precomp.h\n" );
+}
+
+static bool parseOptions( int argc, char **argv, Options &options )
+{
+	for ( int i = 1; i < argc; i++ )
+	{
+		const string name = argv[i];
+		if ( i + 1 >= argc )
+		{
+			fprintf( stderr, "missing value for %s\n", name.c_str() );
+			return false;
+		}
+
+		const char *value = argv[++i];
+		if ( name == "--scene" )
+		{
+			options.scene = value;
+		}
+		else if ( name == "--json" )
+		{
+			options.json = value;
+		}
+		else if ( name == "--label" )
+		{
+			options.label = value;
+		}
+		else if ( name == "--width" || name == "--height" || name == "--frames" || name == "--threads" )
+		{
+			char *end;
+			const unsigned long number = strtoul( value, &end, 10 );
+			if ( *end != '\0' || number == 0 )
+			{
+				fprintf( stderr, "%s needs a positive number, got %s\n", name.c_str(), value );
+				return false;
+			}
+
+			uint &option = name == "--width" ? options.width : name == "--height" ? options.height : name == "--frames" ? options.frames : options.threads;
+			option = uint( number );
+		}
+		else
+		{
+			fprintf( stderr, "unknown option %s\n", name.c_str() );
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// The room of the game, the light comes first
+static void createRoom( vector<Primitive *> &scene, vector<Material> &materials )
+{
+	Material mat;
+
+	mat.albedo = vec3( 1.f, 1.f, 1.f );
+	mat.emission = vec3( 10.f, 10.f, 10.f );
+	mat.type = MaterialType::EMIT_MAT;
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 0.f, -10.f, 15.f ), 3.f, materials.size() - 1 ) );
+
+	mat.type = MaterialType::LAMBERTIAN_MAT;
+	mat.emission = vec3( 0.f, 0.f, 0.f );
+	mat.albedo = vec3( 0.25f, 0.25f, 0.25f );
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 0.f, 1e5f - 10.f, 15.f ), 1e5f, materials.size() - 1 ) );
+
+	mat.albedo = vec3( 0.75f, 0.25f, 0.25f );
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 0.f, 1e5f + 5.f, 15.f ), 1e5f, materials.size() - 1 ) );
+
+	mat.albedo = vec3( 0.25f, 0.25f, 0.75f );
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 0.f, 0.f, 1e5f + 20.f ), 1e5f, materials.size() - 1 ) );
+
+	mat.albedo = vec3( 0.75f, 0.75f, 0.75f );
+	materials.push_back( mat );
+}
+
+static void addTriangle( vector<Primitive *> &scene, uint matIdx, const vec3 &a, const vec3 &b, const vec3 &c )
+{
+	vec3 verts[3] = {a, b, c};
+	vec2 uv[3] = {vec2( 0.f ), vec2( 0.f ), vec2( 0.f )}; // not textured
+	scene.push_back( new Triangle( matIdx, verts, uv ) );
+}
+
+// Unit icosahedron with every face split into four subdivisions times, the vertices pushed out onto the sphere
+static void createIcoSphere( vector<Primitive *> &scene, uint matIdx, const vec3 &center, float radius, int subdivisions )
+{
+	const float p = ( 1.f + sqrtf( 5.f ) ) / 2.f;
+	const vec3 v[12] = {vec3( -1, p, 0 ), vec3( 1, p, 0 ), vec3( -1, -p, 0 ), vec3( 1, -p, 0 ), vec3( 0, -1, p ), vec3( 0, 1, p ),
+						vec3( 0, -1, -p ), vec3( 0, 1, -p ), vec3( p, 0, -1 ), vec3( p, 0, 1 ), vec3( -p, 0, -1 ), vec3( -p, 0, 1 )};
+	const int f[20][3] = {{0, 11, 5}, {0, 5, 1}, {0, 1, 7}, {0, 7, 10}, {0, 10, 11}, {1, 5, 9}, {5, 11, 4}, {11, 10, 2}, {10, 7, 6}, {7, 1, 8},
+						  {3, 9, 4}, {3, 4, 2}, {3, 2, 6}, {3, 6, 8}, {3, 8, 9}, {4, 9, 5}, {2, 4, 11}, {6, 2, 10}, {8, 6, 7}, {9, 8, 1}};
+
+	vector<vec3> faces;
+	for ( int i = 0; i < 20; i++ )
+	{
+		for ( int j = 0; j < 3; j++ )
+		{
+			faces.push_back( normalize( v[f[i][j]] ) );
+		}
+	}
+
+	for ( int s = 0; s < subdivisions; s++ )
+	{
+		vector<vec3> split;
+		for ( size_t i = 0; i < faces.size(); i += 3 )
+		{
+			const vec3 &a = faces[i], &b = faces[i + 1], &c = faces[i + 2];
+			const vec3 ab = normalize( a + b ), bc = normalize( b + c ), ca = normalize( c + a );
+			const vec3 children[12] = {a, ab, ca, ab, b, bc, ca, bc, c, ab, bc, ca};
+			split.insert( split.end(), children, children + 12 );
+		}
+		faces.swap( split );
+	}
+
+	for ( size_t i = 0; i < faces.size(); i += 3 )
+	{
+		addTriangle( scene, matIdx, center + faces[i] * radius, center + faces[i + 1] * radius, center + faces[i + 2] * radius );
+	}
+}
+
+// Rolling terrain over the floor of the room, two triangles per grid cell
+static void createTerrain( vector<Primitive *> &scene, uint matIdx, int cells )
+{
+	const float size = 20.f;
+	auto point = [&]( int i, int j ) {
+		const float x = -size / 2 + size * i / cells;
+		const float z = size * j / cells;
+		return vec3( x, 4.f - sinf( x * 1.3f ) * cosf( z * 0.9f ) - 0.3f * sinf( x * 5.1f + z * 4.3f ), z );
+	};
+
+	for ( int j = 0; j < cells; j++ )
+	{
+		for ( int i = 0; i < cells; i++ )
+		{
+			addTriangle( scene, matIdx, point( i, j ), point( i + 1, j ), point( i + 1, j + 1 ) );
+			addTriangle( scene, matIdx, point( i, j ), point( i + 1, j + 1 ), point( i, j + 1 ) );
+		}
+	}
+}
+
+// The Renderer owns the primitives it is given, these are the ones of a scene that is skipped
+static void deletePrimitives( vector<Primitive *> &scene )
+{
+	for ( Primitive *primitive : scene )
+	{
+		delete primitive;
+	}
+	scene.clear();
+}
+
+static bool addOBJ( vector<Primitive *> &scene, uint matIdx, const char *file )
+{
+	const string path = string( BENCH_ASSETS ) + "/" + file;
+	vector<Primitive *> mesh = loadOBJ( path.c_str(), matIdx );
+	scene.insert( scene.end(), mesh.begin(), mesh.end() );
+	return !mesh.empty();
+}
+
+// The canonical scenes. Models sit in the middle of the room, in front of the camera of the game
+static vector<BenchScene> benchScenes()
+{
+	const BenchCamera front = {"front", vec3( 0.f, 0.f, -2.f ), vec3( 0.f, 0.f, 0.f )};
+	const BenchCamera side = {"side", vec3( 3.f, -1.5f, -3.f ), vec3( 0.f, 0.f, 0.f )};
+
+	vector<BenchScene> scenes;
+	scenes.push_back( {"spheres",
+					   []( vector<Primitive *> &scene, uint matIdx ) {
+						   scene.push_back( new Sphere( vec3( -3.f, 0.f, 12.f ), 2.f, matIdx ) );
+						   scene.push_back( new Sphere( vec3( 4.f, -2.5f, 12.f ), 2.f, matIdx ) );
+						   return true;
+					   },
+					   {front, {"high", vec3( 6.f, -6.f, 0.f ), vec3( 0.f, 0.f, 12.f )}}} );
+	scenes.push_back( {"monkey", []( vector<Primitive *> &scene, uint matIdx ) { return addOBJ( scene, matIdx, "Monkey.obj" ); }, {front, side}} );
+	scenes.push_back( {"cube", []( vector<Primitive *> &scene, uint matIdx ) { return addOBJ( scene, matIdx, "Cube.obj" ); }, {front, side}} );
+
+	// icoSphere.obj is missing from obj.zip, only its material is there. Rebuilt at about the density of the other models
+	scenes.push_back( {"icosphere",
+					   []( vector<Primitive *> &scene, uint matIdx ) {
+						   createIcoSphere( scene, matIdx, vec3( 0.f, 0.f, 0.f ), 1.f, 3 );
+						   return true;
+					   },
+					   {front, side}} );
+	scenes.push_back( {"terrain",
+					   []( vector<Primitive *> &scene, uint matIdx ) {
+						   createTerrain( scene, matIdx, 256 );
+						   return true;
+					   },
+					   {front, side}} );
+	return scenes;
+}
+
+static Camera makeCamera( const BenchCamera &camera, const Options &options )
+{
+	return Camera( camera.origin, camera.target, vec3( 0.f, 1.f, 0.f ), PI / 4, (float)options.width / (float)options.height, 0.f, 0.5f, 1.f );
+}
+
+// Milliseconds of the fastest of BENCH_BATCH_RUNS runs
+template <typename Batch>
+static double fastestRun( Batch batch )
+{
+	double best = DBL_MAX;
+	for ( int run = 0; run < BENCH_BATCH_RUNS; run++ )
+	{
+		double time = 0.0;
+		{
+			const StageTimer timing( time );
+			batch();
+		}
+		best = min( best, time );
+	}
+	return best;
+}
+
+static double raysPerSecond( size_t rays, double time ) { return rays / ( time * 1000.0 ); }
+
+// Camera rays through random pixels, then from their hits a diffuse ray and a shadow ray towards the light
+template <typename Accel>
+static BatchResult traceBatches( const Accel &accel, const vector<Primitive *> &scene, const Camera &cam, const Options &options, uint seed )
+{
+	Random rng( BENCH_SEED, seed, 0 );
+
+	vector<Ray> primary;
+	for ( uint i = 0; i < BENCH_RAYS; i++ )
+	{
+		const uint x = rng.nextUInt() % options.width;
+		const uint y = rng.nextUInt() % options.height;
+		const float u[4] = {rng.nextFloat(), rng.nextFloat(), rng.nextFloat(), rng.nextFloat()};
+		primary.push_back( cam.getRay( x, y, options.width, options.height, u ) );
+	}
+
+	vector<Intersection> isects( primary.size() );
+	BatchResult result;
+	result.primaryRays = primary.size();
+	result.primary = raysPerSecond( primary.size(), fastestRun( [&]() {
+										for ( size_t i = 0; i < primary.size(); i++ )
+										{
+											isects[i] = accel.intersect( primary[i] );
+										}
+									} ) );
+
+	const Primitive &light = *scene[0];
+	vector<Ray> diffuse;
+	vector<Ray> shadow;
+	vector<float> shadowDistance;
+	for ( size_t i = 0; i < primary.size(); i++ )
+	{
+		if ( isects[i].primId == NO_PRIMITIVE || isects[i].primId == 0 )
+		{
+			continue;
+		}
+
+		Hit hit = scene[isects[i].primId]->getHit( primary[i], isects[i] );
+		if ( dot( hit.normal, primary[i].direction ) > 0.f )
+		{
+			hit.normal = -hit.normal;
+		}
+
+		float pdf;
+		const float u1 = rng.nextFloat();
+		const float u2 = rng.nextFloat();
+		diffuse.push_back( Ray( hit.coordinates + hit.normal * DIFFUSEBIAS, Basis( hit.normal ).toWorld( Sample::cosineSampleHemisphere( u1, u2, pdf ) ) ) );
+
+		const vec3 origin = hit.coordinates + hit.normal * SHADOWBIAS;
+		const float u3 = rng.nextFloat();
+		const float u4 = rng.nextFloat();
+		const vec3 toLight = light.samplePoint( origin, u3, u4, pdf ) - origin;
+		const float distance = toLight.length();
+		shadow.push_back( Ray( origin, toLight * ( 1.f / distance ) ) );
+		shadowDistance.push_back( distance - SHADOWBIAS );
+	}
+
+	result.diffuseRays = diffuse.size();
+	result.diffuse = raysPerSecond( diffuse.size(), fastestRun( [&]() {
+										for ( const Ray &r : diffuse )
+										{
+											accel.intersect( r );
+										}
+									} ) );
+
+	result.shadowRays = shadow.size();
+	result.shadow = raysPerSecond( shadow.size(), fastestRun( [&]() {
+									   for ( size_t i = 0; i < shadow.size(); i++ )
+									   {
+										   accel.occluded( shadow[i], shadowDistance[i] );
+									   }
+								   } ) );
+
+	// The way secondary rays used to be traced, for the regression check
+	double linearTime = 0.0;
+	{
+		const StageTimer timing( linearTime );
+		for ( uint i = 0; i < BENCH_LINEAR_RAYS; i++ )
+		{
+			Intersection isect;
+			for ( Primitive *p : scene )
+			{
+				p->intersect( primary[i], isect );
+			}
+		}
+	}
+	result.linearPerRay = float( linearTime * 1000.0 / BENCH_LINEAR_RAYS );
+
+	return result;
+}
+
+// Average frame time after one warm up frame, which also applies the camera
+static FrameResult renderFrames( Renderer &renderer, const Camera &cam, const Options &options, const BatchResult &batches )
+{
+	renderer.setCamera( cam );
+	renderer.renderFrame();
+
+	FrameResult result;
+	double time = 0.0;
+	for ( uint i = 0; i < options.frames; i++ )
+	{
+		{
+			const StageTimer timing( time );
+			renderer.renderFrame();
+		}
+		result.stats += renderer.getStats();
+	}
+	result.frameTime = time / options.frames;
+
+	// What the frame would cost with camera rays through the BVH but shadow and diffuse rays scanning every primitive.
+	// Only the first bounce is counted, so this underestimates the linear cost of longer paths
+	const float pixels = (float)options.width * options.height;
+	const float treePerRay = float( 1.0 / batches.primary ) * 1e-3f;
+	const float linearFrameTime = pixels * ( treePerRay + 2 * SAMPLES * batches.linearPerRay * 1e-3f ) / options.threads;
+	result.speedup = float( linearFrameTime / result.frameTime );
+
+	return result;
+}
+
+static string jsonString( const string &text )
+{
+	string quoted = "\"";
+	for ( char c : text )
+	{
+		if ( c == '"' || c == '\\' )
+		{
+			quoted += '\\';
+		}
+		quoted += c;
+	}
+	return quoted + "\"";
+}
+
+int main( int argc, char **argv )
+{
+	Options options;
+	if ( !parseOptions( argc, argv, options ) )
+	{
+		printUsage();
+		return 1;
+	}
+
+	vector<BenchScene> scenes = benchScenes();
+	if ( !options.scene.empty() )
+	{
+		scenes.erase( remove_if( scenes.begin(), scenes.end(), [&]( const BenchScene &scene ) { return options.scene != scene.name; } ), scenes.end() );
+		if ( scenes.empty() )
+		{
+			fprintf( stderr, "no scene named %s\n", options.scene.c_str() );
+			return 1;
+		}
+	}
+
+	FILE *json = stdout;
+	if ( !options.json.empty() && !( json = fopen( options.json.c_str(), "w" ) ) )
+	{
+		fprintf( stderr, "could not write %s\n", options.json.c_str() );
+		return 1;
+	}
+
+	// The BVH build runs on OpenMP, the frames on the renderer's own threads. The ray batches are single threaded
+	omp_set_num_threads( options.threads );
+
+	fprintf( json, "{\n  \"label\": %s,\n", jsonString( options.label ).c_str() );
+	fprintf( json, "  \"config\": {\"width\": %u, \"height\": %u, \"frames\": %u, \"threads\": %u, \"samples\": %d, \"max_ray_depth\": %d, ", options.width, options.height, options.frames, options.threads, SAMPLES, MAXRAYDEPTH );
+	fprintf( json, "\"bincount\": %d, \"mbvh_width\": %d, \"batch_rays\": %d, \"seed\": %d},\n", BINCOUNT, MBVH_WIDTH, BENCH_RAYS, BENCH_SEED );
+	fprintf( json, "  \"scenes\": [" );
+
+	bool failed = false;
+	bool found = false; // a scene was written
+	for ( const BenchScene &benchScene : scenes )
+	{
+		vector<Primitive *> scene;
+		vector<Material> materials;
+		createRoom( scene, materials );
+		if ( !benchScene.create( scene, materials.size() - 1 ) )
+		{
+			fprintf( stderr, "%s: could not load the model from %s\n", benchScene.name, BENCH_ASSETS );
+			deletePrimitives( scene );
+			failed = true;
+			continue;
+		}
+
+		fprintf( stderr, "%s: %zu primitives\n", benchScene.name, scene.size() );
+		fprintf( json, "%s\n    {\"name\": \"%s\", \"primitives\": %zu, ", found ? "," : "", benchScene.name, scene.size() );
+		found = true;
+
+		// Both structures the renderer builds, the wide one is collapsed from the binary one
+		double buildTime = 0.0;
+		double collapseTime = 0.0;
+		BVH *bvh;
+		{
+			const StageTimer timing( buildTime );
+			bvh = new BVH( scene );
+		}
+#ifdef USE_MBVH
+		MBVH *mbvh;
+		{
+			const StageTimer timing( collapseTime );
+			mbvh = new MBVH( *bvh );
+		}
+#endif
+		fprintf( json, "\"build_ms\": %.3f, \"collapse_ms\": %.3f,\n     \"cameras\": [", buildTime, collapseTime );
+
+		Renderer *renderer = new Renderer( scene, materials, options.width, options.height, TILESIZE, options.threads );
+		for ( size_t c = 0; c < benchScene.cameras.size(); c++ )
+		{
+			const BenchCamera &camera = benchScene.cameras[c];
+			const Camera cam = makeCamera( camera, options );
+
+#ifdef USE_MBVH
+			const BatchResult batches = traceBatches( *mbvh, scene, cam, options, c );
+#else
+			const BatchResult batches = traceBatches( *bvh, scene, cam, options, c );
+#endif
+			const FrameResult frames = renderFrames( *renderer, cam, options, batches );
+			const RenderStats &stats = frames.stats;
+
+			fprintf( stderr, "  %s: primary %.2f, diffuse %.2f, shadow %.2f Mrays/s, frame %.1f ms (%.1fx linear)\n", camera.name, batches.primary, batches.diffuse, batches.shadow, frames.frameTime, frames.speedup );
+
+			fprintf( json, "%s\n      {\"name\": \"%s\", ", c > 0 ? "," : "", camera.name );
+			fprintf( json, "\"primary\": {\"rays\": %u, \"mrays_s\": %.3f}, \"diffuse\": {\"rays\": %u, \"mrays_s\": %.3f}, \"shadow\": {\"rays\": %u, \"mrays_s\": %.3f},\n", batches.primaryRays, batches.primary, batches.diffuseRays, batches.diffuse, batches.shadowRays, batches.shadow );
+			fprintf( json, "       \"frame\": {\"ms\": %.3f, \"mrays_s\": %.3f, \"primary_rays\": %" PRIu64 ", \"secondary_rays\": %" PRIu64 ", \"shadow_rays\": %" PRIu64 ", ", frames.frameTime, stats.rays() / ( frames.frameTime * options.frames * 1000.0 ), stats.primaryRays, stats.secondaryRays, stats.shadowRays );
+			const uint64_t rays = max( stats.rays(), uint64_t( 1 ) );
+			fprintf( json, "\"nodes_per_ray\": %.3f, \"tests_per_ray\": %.3f, ", stats.nodesVisited / double( rays ), stats.primitiveTests / double( rays ) );
+#ifdef TRAVERSAL_TIMING
+			fprintf( json, "\"traverse_ms\": %.3f, \"shade_ms\": %.3f, \"resolve_ms\": %.3f},\n", stats.traverseTime / options.frames, stats.shadeTime / options.frames, stats.resolveTime / options.frames );
+#else
+			// Traversal is not timed, shading includes it
+			fprintf( json, "\"traverse_ms\": null, \"shade_ms\": %.3f, \"resolve_ms\": %.3f},\n", stats.shadeTime / options.frames, stats.resolveTime / options.frames );
+#endif
+			fprintf( json, "       \"linear_us_per_ray\": %.3f, \"speedup\": %.3f}", batches.linearPerRay, frames.speedup );
+
+			if ( scene.size() >= BENCH_CHECK_PRIMITIVES && frames.speedup < BENCH_MIN_SPEEDUP )
+			{
+				fprintf( stderr, "REGRESSION: %s %s frame time is not at least %.1fx below the linear estimate\n", benchScene.name, camera.name, BENCH_MIN_SPEEDUP );
+				failed = true;
+			}
+		}
+		fprintf( json, "]}" );
+
+		// The renderer owns the primitives, the structures only point at them
+#ifdef USE_MBVH
+		delete mbvh;
+#endif
+		delete bvh;
+		delete renderer;
+	}
+	fprintf( json, "\n  ]\n}\n" );
+
+	if ( json != stdout )
+	{
+		fclose( json );
+	}
+
+	return failed ? 1 : 0;
+}
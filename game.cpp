@@ -11,46 +11,48 @@ void Game::Init()
 {
 	Camera cam = Camera( vec3( 0.f, 0.f, -2.f ), vec3( 0.f, 0.f, 0.f ), vec3( 0.f, 1.f, 0.f ), PI / 4, ( (float)SCRWIDTH / (float)SCRHEIGHT ), 0.f, 0.5f, 1.f );
 
-	Material mat;
-	mat.type = MaterialType::LAMBERTIAN_MAT;
-	mat.albedo = vec3( 0.75f, 0.25f, 0.25f );
-	mat.emission = vec3( 0.f, 0.f, 0.f );
-
+	// Primitives refer to their material by its index in this table
+	vector<Material> materials;
 	vector<Primitive *> scene;
 
+	Material mat;
+
 	// Light
 	mat.albedo = vec3( 1.f, 1.f, 1.f );
 	mat.emission = vec3( 10.f, 10.f, 10.f );
 	mat.type = MaterialType::EMIT_MAT;
-	scene.push_back( new Sphere( vec3( 0.f, -10.f, 15.f ), 3.f, mat ) );
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 0.f, -10.f, 15.f ), 3.f, materials.size() - 1 ) );
 
 	// Spheres
 	mat.type = MaterialType::LAMBERTIAN_MAT;
 	mat.albedo = vec3( 0.25f, 0.25f, 0.25f );
 	mat.emission = vec3( 0.f, 0.f, 0.f );
-	scene.push_back( new Sphere( vec3( 0.f, 1e5f - 10.f, 15.f ), 1e5f, mat ) );
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 0.f, 1e5f - 10.f, 15.f ), 1e5f, materials.size() - 1 ) );
 
 	mat.albedo = vec3( 0.75f, 0.25f, 0.25f );
-	mat.emission = vec3( 0.f, 0.f, 0.f );
-	scene.push_back( new Sphere( vec3( 0.f, 1e5f + 5.f, 15.f ), 1e5f, mat ) );
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 0.f, 1e5f + 5.f, 15.f ), 1e5f, materials.size() - 1 ) );
 
 	mat.albedo = vec3( 0.25f, 0.25f, 0.75f );
-	mat.emission = vec3( 0.f, 0.f, 0.f );
-	scene.push_back( new Sphere( vec3( 0.f, 0.f, 1e5f + 20.f ), 1e5f, mat ) );
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 0.f, 0.f, 1e5f + 20.f ), 1e5f, materials.size() - 1 ) );
 
 	mat.albedo = vec3( 0.25f, 0.75f, 0.25f );
-	mat.emission = vec3( 0.f, 0.f, 0.f );
-	scene.push_back( new Sphere( vec3( -3.f, 0.f, 12.f ), 2.f, mat ) );
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( -3.f, 0.f, 12.f ), 2.f, materials.size() - 1 ) );
 
 	mat.albedo = vec3( 0.1f, 0.3f, 0.6f );
-	mat.emission = vec3( 0.f, 0.f, 0.f );
-	scene.push_back( new Sphere( vec3( 4.f, -2.5f, 12.f ), 2.f, mat ) );
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 4.f, -2.5f, 12.f ), 2.f, materials.size() - 1 ) );
 
-	renderer = new Renderer( scene );
+	renderer = new Renderer( scene, materials );
 	noPrim = scene.size();
 	noLight = 1; // lights.size();
 	renderer->setCamera( cam );
 	// renderer->setLights( lights );
+	renderer->start();
 }
 
 // -----------------------------------------------------------
@@ -62,6 +64,7 @@ void Game::Shutdown()
 }
 
 bool showHelp = false;
+bool recordStats = false; // a CSV line per iteration in stats.csv
 
 bool moveLeft = false;
 bool moveRight = false;
@@ -174,25 +177,33 @@ void Game::Tick( float deltaTime )
 		renderer->changeAperture( -0.05f );
 	}
 
-	// clear the graphics window
-	screen->Clear( 0 );   /// I COMMENTED THAT OUT
-
-	// Render the frame
-	timer t = timer();
-	renderer->renderFrame();
-	float elapsed = t.elapsed();
-	float fps = 1 / ( elapsed / 1000 );
-
-	// Display
-	screen->SetBuffer( renderer->getOutput() );
+	// Display the latest iteration of the render thread, copied so the text below does not end up in its frames.
+	// Row by row, the frame and the screen need not have the same size after a resize
+	const Pixel *frame = renderer->getOutput();
+	const uint frameWidth = renderer->getWidth();
+	const uint rows = min( renderer->getHeight(), uint( screen->GetHeight() ) );
+	const uint columns = min( frameWidth, uint( screen->GetWidth() ) );
+	if ( rows < uint( screen->GetHeight() ) || columns < uint( screen->GetWidth() ) )
+	{
+		screen->Clear( 0 );
+	}
+	for ( uint y = 0; y < rows; y++ )
+	{
+		memcpy( screen->GetBuffer() + y * screen->GetPitch(), frame + y * frameWidth, columns * sizeof( Pixel ) );
+	}
+	// No iteration has completed during the first ticks
+	const float frameTime = renderer->getFrameTime();
+	float fps = frameTime > 0.f ? 1000.f / frameTime : 0.f;
+	string status = renderer->isConverged() ? "Converged" : "FPS: " + to_string( fps );
+	Camera cam = renderer->getCamera();
 	if ( !showHelp )
 	{
-		screen->Print( ( "FPS: " + to_string( fps ) ).c_str(), 2, 2, 0xFFFFFF );
+		screen->Print( status.c_str(), 2, 2, 0xFFFFFF );
 		screen->Print( "Press \"h\" for controls", 2, 10, 0xFFFFFF );
 	}
 	else
 	{
-		screen->Print( ( "FPS: " + to_string( fps ) + " " + to_string( noPrim ) + " Primitives, " + to_string( noLight ) + " Lights" ).c_str(), 2, 2, 0xFFFFFF );
+		screen->Print( ( status + " " + to_string( noPrim ) + " Primitives, " + to_string( noLight ) + " Lights" ).c_str(), 2, 2, 0xFFFFFF );
 		screen->Print( "W - Move forward\n", 2, 10, 0xFFFFFF );
 		screen->Print( "S - Move back\n", 2, 18, 0xFFFFFF );
 		screen->Print( "A - Move left\n", 2, 26, 0xFFFFFF );
@@ -207,10 +218,29 @@ void Game::Tick( float deltaTime )
 		screen->Print( "G - Zoom out\n", 2, 98, 0xFFFFFF );
 		screen->Print( "Z - Aperture increase\n", 2, 106, 0xFFFFFF );
 		screen->Print( "X - Aperture decrease\n", 2, 114, 0xFFFFFF );
+		screen->Print( recordStats ? "C - Stop recording stats.csv\n" : "C - Record stats to stats.csv\n", 2, 122, 0xFFFFFF );
+
+		// Where the last iteration spent its time, thread times add up to the frame time times the thread count
+		const RenderStats stats = renderer->getStats();
+		char line[128];
+		snprintf( line, sizeof( line ), "Rays: %.2fM primary, %.2fM secondary, %.2fM shadow", stats.primaryRays * 1e-6f, stats.secondaryRays * 1e-6f, stats.shadowRays * 1e-6f );
+		screen->Print( line, 2, 138, 0xFFFFFF );
+		snprintf( line, sizeof( line ), "%.2f Mrays/s", frameTime > 0.f ? stats.rays() / ( frameTime * 1000.f ) : 0.f );
+		screen->Print( line, 2, 146, 0xFFFFFF );
+		const float rays = float( max( stats.rays(), uint64_t( 1 ) ) );
+		snprintf( line, sizeof( line ), "BVH: %.1f nodes, %.1f primitive tests per ray", stats.nodesVisited / rays, stats.primitiveTests / rays );
+		screen->Print( line, 2, 154, 0xFFFFFF );
+#ifdef TRAVERSAL_TIMING
+		snprintf( line, sizeof( line ), "Thread ms: traverse %.1f, shade %.1f, resolve %.1f", stats.traverseTime, stats.shadeTime, stats.resolveTime );
+#else
+		snprintf( line, sizeof( line ), "Thread ms: trace %.1f, resolve %.1f (TRAVERSAL_TIMING splits trace)", stats.shadeTime, stats.resolveTime );
+#endif
+		screen->Print( line, 2, 162, 0xFFFFFF );
+
 		screen->Print( "X", SCRWIDTH / 2, SCRHEIGHT / 2, 0xFFFFFF );
-		screen->Print( ( "Aperture: " + to_string( renderer->getCamera()->aperture ) ).c_str(), 2, SCRHEIGHT - 24, 0xFFFFFF );
-		screen->Print( ( "Focal Length: " + to_string( renderer->getCamera()->focalLength ) ).c_str(), 2, SCRHEIGHT - 16, 0xFFFFFF );
-		screen->Print( ( "Focus Distance: " + to_string( renderer->getCamera()->focusDistance ) ).c_str(), 2, SCRHEIGHT - 8, 0xFFFFFF );
+		screen->Print( ( "Aperture: " + to_string( cam.aperture ) ).c_str(), 2, SCRHEIGHT - 24, 0xFFFFFF );
+		screen->Print( ( "Focal Length: " + to_string( cam.focalLength ) ).c_str(), 2, SCRHEIGHT - 16, 0xFFFFFF );
+		screen->Print( ( "Focus Distance: " + to_string( cam.focusDistance ) ).c_str(), 2, SCRHEIGHT - 8, 0xFFFFFF );
 	}
 }
 
@@ -306,6 +336,10 @@ void Tmpl8::Game::KeyDown( int key )
 	case SDL_SCANCODE_H:
 		showHelp = !showHelp;
 		break;
+	case SDL_SCANCODE_C:
+		recordStats = !recordStats;
+		recordStats = renderer->recordStats( recordStats ? "stats.csv" : nullptr ) && recordStats;
+		break;
 	case SDL_SCANCODE_LEFT:
 		rotLeft = true;
 		break;
@@ -9,9 +9,9 @@
 
 #define MAX_IDLE_FPS 60.f
 
-#define SCRWIDTH 512
+#define SCRWIDTH 512 // window size, and the default for a Renderer
 #define SCRHEIGHT 512
-#define TILESIZE 64
+#define TILESIZE 16 // default, the Renderer takes its tile size at construction
 
 //#define LINEAR_TRAVERSE
 #define USE_SAH
@@ -19,25 +19,50 @@
 //#define BVH_DEBUG
 #define BVHDEPTH 128
 #define BINCOUNT 16 // this can also be reduced for faster construction
+#define BVH_TASK_THRESHOLD 4096 // smaller subtrees are built as independent tasks, larger nodes bin in parallel
+#define USE_MBVH // collapse the BVH into a wide BVH for traversal
+#ifdef __AVX2__
+#define MBVH_WIDTH 8
+#else
+#define MBVH_WIDTH 4
+#endif
+
+#define USE_PACKETS // trace primary rays in packets through the binary BVH
+#define PACKETSIZE 4 // packets are PACKETSIZE x PACKETSIZE pixels, a multiple of MBVH_WIDTH. Other tile sizes are traced ray by ray
 
-#define MAXRAYDEPTH 8
+//#define USE_WAVEFRONT // render a frame one bounce at a time over batches of rays, instead of one pixel at a time
+#define WAVEFRONT_BATCH 65536 // pixels per wavefront batch, bounds the size of the ray buffers
+#define SORT_RAYS // sort continuation rays by direction octant before tracing them
+
+#define MAXRAYDEPTH 8 // hits along a path, the hard limit on its length
+#define RUSSIAN_ROULETTE_DEPTH 3 // bounces a path always survives before Russian roulette can end it
 #define SAMPLES 4
 #define ITERATIONS 1024
+#define ADAPTIVE_SAMPLING // stop tracing tiles that are converged, so the noisy ones get all threads
+#define ADAPTIVE_THRESHOLD 0.02f // largest standard error of a pixel in a converged tile, after gamma correction
+#define ADAPTIVE_MIN_ITERATIONS 16 // a tile is not tested before this, the variance estimate is too rough
 
 #define SHADOWBIAS 0.001f
 #define REFLECTIONBIAS 0.001f
 #define REFRACTIONBIAS 0.001f
+#define DIFFUSEBIAS 0.001f
 #define EPSILON 0.0001f
 
 #define AMBIENTLIGHT 0.f
 
+//#define TRAVERSAL_TIMING // time a sample of the BVH traversals for the stats, to split tracing time into traversal and shading
+#define STATS_TIMING_INTERVAL 16 // one in this many BVH traversals is timed for the stats, the clock is too slow to read around every one
+
 // #define FULLSCREEN
 // #define ADVANCEDGL	// faster if your system supports it
 
+// Tools built with HEADLESS never open a window, and do without OpenGL and SDL
+#ifndef HEADLESS
 // Glew should be included first
 #include <GL/glew.h>
 // Comment for autoformatters: prevent reordering these two.
 #include <GL/gl.h>
+#endif
 
 #ifdef _WIN32
 // Followed by the Windows header
@@ -45,36 +70,61 @@
 
 // Then import wglext: This library tries to include the Windows
 // header WIN32_LEAN_AND_MEAN, unless it was already imported.
+#ifndef HEADLESS
 #include <GL/wglext.h>
+#endif
 
 // Extra definitions for redirectIO
 #include <fcntl.h>
 #include <io.h>
+#else
+// Memory-mapped files, for the scene cache
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 // External dependencies:
 #include <FreeImage.h>
+#ifndef HEADLESS
 #include <SDL2/SDL.h>
+#endif
 
 // C++ headers
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <string>
 #include <thread>
 #include <tuple>
 #include <vector>
-#include <random>
+
+// OpenMP, with serial stand-ins when it is disabled
+#ifdef _OPENMP
+#include <omp.h>
+#else
+inline int omp_get_max_threads() { return 1; }
+inline int omp_get_thread_num() { return 0; }
+inline void omp_set_num_threads( int ) {}
+#endif
 
 // Namespaced C headers:
 #include <cassert>
+#include <cfloat>
 #include <cinttypes>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 // Header for AVX, and every technology before it.
 // If your CPU does not support this, include the appropriate header instead.
@@ -97,10 +147,15 @@ using namespace Tmpl8;
 #include "Light.h"
 #include "Ray.h"
 #include "Camera.h"
+#include "Sample.h"
 #include "Primitive.h"
 #include "OBJLoader.h"
+#include "Stats.h"
 #include "BVH.h"
-#include "Sample.h"
+#include "MBVH.h"
+#include "SceneCache.h"
+#include "Random.h"
+#include "Scheduler.h"
 #include "Renderer.h"
 
 #include "game.h"
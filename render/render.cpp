@@ -0,0 +1,303 @@
+#include "precomp.h"
+
+// Offline renderer without a window, for batch rendering on machines without a GPU.
+// Renders up to a number of samples per pixel, writes the image through FreeImage and reports where the time went.
+//
+//   render [--scene file.obj] [--width w] [--height h] [--tile n] [--spp n] [--threads n] [--out image.png] [--stats file.csv] [--cache file]
+//
+// Without --scene the sphere room of the game is rendered, a model is placed in the middle of it.
+// The image format follows the extension: .exr and .hdr get the linear radiance, anything else the frame as shown on screen.
+// --stats writes the rays, BVH work and stage times of every iteration. Traversal is timed apart from shading only in
+// builds with TRAVERSAL_TIMING defined, otherwise traverse_ms stays 0 and shade_ms includes it.
+// A model and its BVH are cached in file.obj.cache after the first run, --cache picks another file or turns it off with none.
+
+struct Options
+{
+	string scene;
+	uint width = SCRWIDTH;
+	uint height = SCRHEIGHT;
+	uint tileSize = TILESIZE;
+	uint spp = 64 * SAMPLES;
+	uint threads = max( 1u, thread::hardware_concurrency() );
+	string out = "render.png";
+	string stats;
+	string cache;
+};
+
+static void printUsage()
+{
+	fprintf( stderr, "usage: render [--scene file.obj] [--width w] [--height h] [--tile n] [--spp n] [--threads n] [--out image.png] [--stats file.csv] [--cache file]\n" );
+	fprintf( stderr, "traverse times need a build with TRAVERSAL_TIMING defined in precomp.h\n" );
+}
+
+static bool parseOptions( int argc, char **argv, Options &options )
+{
+	for ( int i = 1; i < argc; i++ )
+	{
+		const string name = argv[i];
+		if ( i + 1 >= argc )
+		{
+			fprintf( stderr, "missing value for %s\n", name.c_str() );
+			return false;
+		}
+
+		const char *value = argv[++i];
+		if ( name == "--scene" )
+		{
+			options.scene = value;
+		}
+		else if ( name == "--out" )
+		{
+			options.out = value;
+		}
+		else if ( name == "--stats" )
+		{
+			options.stats = value;
+		}
+		else if ( name == "--cache" )
+		{
+			options.cache = value;
+		}
+		else if ( name == "--width" || name == "--height" || name == "--tile" || name == "--spp" || name == "--threads" )
+		{
+			char *end;
+			const unsigned long number = strtoul( value, &end, 10 );
+			if ( *end != '\0' || number == 0 )
+			{
+				fprintf( stderr, "%s needs a positive number, got %s\n", name.c_str(), value );
+				return false;
+			}
+
+			uint &option = name == "--width" ? options.width : name == "--height" ? options.height : name == "--tile" ? options.tileSize : name == "--spp" ? options.spp : options.threads;
+			option = uint( number );
+		}
+		else
+		{
+			fprintf( stderr, "unknown option %s\n", name.c_str() );
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// The room of the game. Without a model it gets the spheres of the game, otherwise the material of the model comes last
+static void createRoom( vector<Primitive *> &scene, vector<Material> &materials, bool withModel )
+{
+	Material mat;
+
+	mat.albedo = vec3( 1.f, 1.f, 1.f );
+	mat.emission = vec3( 10.f, 10.f, 10.f );
+	mat.type = MaterialType::EMIT_MAT;
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 0.f, -10.f, 15.f ), 3.f, materials.size() - 1 ) );
+
+	mat.type = MaterialType::LAMBERTIAN_MAT;
+	mat.emission = vec3( 0.f, 0.f, 0.f );
+	mat.albedo = vec3( 0.25f, 0.25f, 0.25f );
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 0.f, 1e5f - 10.f, 15.f ), 1e5f, materials.size() - 1 ) );
+
+	mat.albedo = vec3( 0.75f, 0.25f, 0.25f );
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 0.f, 1e5f + 5.f, 15.f ), 1e5f, materials.size() - 1 ) );
+
+	mat.albedo = vec3( 0.25f, 0.25f, 0.75f );
+	materials.push_back( mat );
+	scene.push_back( new Sphere( vec3( 0.f, 0.f, 1e5f + 20.f ), 1e5f, materials.size() - 1 ) );
+
+	if ( !withModel )
+	{
+		mat.albedo = vec3( 0.25f, 0.75f, 0.25f );
+		materials.push_back( mat );
+		scene.push_back( new Sphere( vec3( -3.f, 0.f, 12.f ), 2.f, materials.size() - 1 ) );
+
+		mat.albedo = vec3( 0.1f, 0.3f, 0.6f );
+		materials.push_back( mat );
+		scene.push_back( new Sphere( vec3( 4.f, -2.5f, 12.f ), 2.f, materials.size() - 1 ) );
+	}
+	else
+	{
+		mat.albedo = vec3( 0.75f, 0.75f, 0.75f );
+		materials.push_back( mat );
+	}
+}
+
+// The Renderer owns the primitives it is given, these are the ones that never reach it
+static void deletePrimitives( vector<Primitive *> &scene )
+{
+	for ( Primitive *primitive : scene )
+	{
+		delete primitive;
+	}
+	scene.clear();
+}
+
+static bool writeImage( Renderer &renderer, const string &file, FREE_IMAGE_FORMAT fif )
+{
+	const uint width = renderer.getWidth();
+	const uint height = renderer.getHeight();
+
+	// FreeImage stores the bottom row first
+	FIBITMAP *dib;
+	if ( fif == FIF_EXR || fif == FIF_HDR )
+	{
+		vector<float> radiance( width * height * 3 );
+		renderer.getRadiance( radiance.data() );
+
+		dib = FreeImage_AllocateT( FIT_RGBF, width, height );
+		for ( uint y = 0; y < height; y++ )
+		{
+			FIRGBF *line = (FIRGBF *)FreeImage_GetScanLine( dib, height - 1 - y );
+			for ( uint x = 0; x < width; x++ )
+			{
+				const float *rgb = &radiance[( y * width + x ) * 3];
+				line[x].red = rgb[0];
+				line[x].green = rgb[1];
+				line[x].blue = rgb[2];
+			}
+		}
+	}
+	else
+	{
+		// A Pixel is 0xAARRGGBB, the layout of a 32 bit FreeImage bitmap on little endian machines
+		const Pixel *frame = renderer.getOutput();
+		FIBITMAP *bgra = FreeImage_Allocate( width, height, 32 );
+		for ( uint y = 0; y < height; y++ )
+		{
+			memcpy( FreeImage_GetScanLine( bgra, height - 1 - y ), frame + y * width, width * sizeof( Pixel ) );
+		}
+
+		dib = FreeImage_ConvertTo24Bits( bgra );
+		FreeImage_Unload( bgra );
+	}
+
+	const bool saved = FreeImage_Save( fif, dib, file.c_str() ) != 0;
+	FreeImage_Unload( dib );
+
+	if ( !saved )
+	{
+		fprintf( stderr, "could not write %s\n", file.c_str() );
+	}
+	return saved;
+}
+
+int main( int argc, char **argv )
+{
+	Options options;
+	if ( !parseOptions( argc, argv, options ) )
+	{
+		printUsage();
+		return 1;
+	}
+
+	// Checked up front, a long render should not be lost to a typo
+	const FREE_IMAGE_FORMAT fif = FreeImage_GetFIFFromFilename( options.out.c_str() );
+	if ( fif == FIF_UNKNOWN )
+	{
+		fprintf( stderr, "unknown image format: %s\n", options.out.c_str() );
+		return 1;
+	}
+
+	timer wallTimer;
+
+	// The BVH build and the wavefront passes run on OpenMP, the tiles on the renderer's own threads
+	omp_set_num_threads( options.threads );
+
+	timer loadTimer;
+	vector<Primitive *> scene;
+	vector<Material> materials;
+	createRoom( scene, materials, !options.scene.empty() );
+
+	// The cache holds the whole scene, so it is keyed on the room as well as on the model
+	SceneCache cache;
+	const bool useCache = !options.scene.empty() && options.cache != "none";
+	const string cacheFile = options.cache.empty() ? options.scene + ".cache" : options.cache;
+	const uint64_t cacheKey = useCache ? SceneCache::hashFile( options.scene.c_str(), SceneCache::hashScene( scene, materials ) ) : 0;
+	const bool cached = useCache && cache.open( cacheFile.c_str(), cacheKey );
+
+	if ( cached )
+	{
+		deletePrimitives( scene );
+	}
+	else if ( !options.scene.empty() )
+	{
+		vector<Primitive *> mesh = loadOBJ( options.scene.c_str(), materials.size() - 1 );
+		if ( mesh.empty() )
+		{
+			fprintf( stderr, "could not load %s\n", options.scene.c_str() );
+			deletePrimitives( scene );
+			return 1;
+		}
+		scene.insert( scene.end(), mesh.begin(), mesh.end() );
+	}
+	const float loadTime = loadTimer.elapsed();
+
+	timer buildTimer;
+	Renderer *renderer = cached ? new Renderer( cache, options.width, options.height, options.tileSize, options.threads ) : new Renderer( scene, materials, options.width, options.height, options.tileSize, options.threads );
+	const float buildTime = buildTimer.elapsed();
+	const size_t primitiveCount = renderer->getBVH().getPrimitives().size();
+
+	if ( cached )
+	{
+		printf( "cache: loaded %s\n", cacheFile.c_str() );
+	}
+	else if ( useCache )
+	{
+		timer cacheTimer;
+		if ( SceneCache::write( cacheFile.c_str(), cacheKey, renderer->getBVH(), materials ) )
+		{
+			printf( "cache: wrote %s in %.1f ms\n", cacheFile.c_str(), cacheTimer.elapsed() );
+		}
+		else
+		{
+			fprintf( stderr, "could not write the scene cache %s\n", cacheFile.c_str() );
+		}
+	}
+
+	renderer->setCamera( Camera( vec3( 0.f, 0.f, -2.f ), vec3( 0.f, 0.f, 0.f ), vec3( 0.f, 1.f, 0.f ), PI / 4, ( (float)options.width / (float)options.height ), 0.f, 0.5f, 1.f ) );
+
+	// Every iteration traces SAMPLES paths per pixel. Adaptive sampling can finish before all of them are done
+	renderer->setMaxIterations( ( options.spp + SAMPLES - 1 ) / SAMPLES );
+
+	if ( !options.stats.empty() && !renderer->recordStats( options.stats.c_str() ) )
+	{
+		fprintf( stderr, "could not write %s\n", options.stats.c_str() );
+		delete renderer;
+		return 1;
+	}
+
+	RenderStats stats;
+	timer renderTimer;
+	while ( !renderer->isConverged() )
+	{
+		renderer->renderFrame();
+		stats += renderer->getStats();
+	}
+	const float renderTime = renderTimer.elapsed();
+
+	timer writeTimer;
+	const bool written = writeImage( *renderer, options.out, fif );
+	const float writeTime = writeTimer.elapsed();
+
+	const uint iterations = renderer->getIterations();
+	delete renderer;
+
+	printf( "scene: %s, %zu primitives\n", options.scene.empty() ? "sphere room" : options.scene.c_str(), primitiveCount );
+	printf( "image: %s, %ux%u in %u pixel tiles, %u iterations of %d samples, %u threads\n", options.out.c_str(), options.width, options.height, options.tileSize, iterations, SAMPLES, options.threads );
+	if ( iterations * SAMPLES < options.spp )
+	{
+		printf( "converged: every tile met the noise threshold after %u of the %u requested samples per pixel\n", iterations * SAMPLES, options.spp );
+	}
+	printf( "load %.1f ms, build %.1f ms, render %.1f ms (%.2f ms/iteration), write %.1f ms\n", loadTime, buildTime, renderTime, renderTime / max( 1u, iterations ), writeTime );
+	printf( "rays: %" PRIu64 " primary, %" PRIu64 " secondary, %" PRIu64 " shadow, %.3f M/s, paths %.3f M/s\n", stats.primaryRays, stats.secondaryRays, stats.shadowRays, stats.rays() / ( renderTime * 1000.f ), stats.primaryRays * SAMPLES / ( renderTime * 1000.f ) );
+	printf( "bvh: %.1f nodes, %.1f primitive tests per ray\n", stats.nodesVisited / double( max( stats.rays(), uint64_t( 1 ) ) ), stats.primitiveTests / double( max( stats.rays(), uint64_t( 1 ) ) ) );
+#ifdef TRAVERSAL_TIMING
+	printf( "thread time: traverse %.1f ms, shade %.1f ms, resolve %.1f ms\n", stats.traverseTime, stats.shadeTime, stats.resolveTime );
+#else
+	printf( "thread time: trace %.1f ms, resolve %.1f ms\n", stats.shadeTime, stats.resolveTime );
+#endif
+	printf( "wall: %.1f ms\n", wallTimer.elapsed() );
+
+	return written ? 0 : 1;
+}
@@ -97,6 +97,9 @@ void NotifyUser( const char *s )
 }
 }
 
+// Tools such as the benchmark only need the math above, and provide their own main
+#ifndef HEADLESS
+
 using namespace Tmpl8;
 using namespace std;
 
@@ -342,3 +345,5 @@ int main( int argc, char **argv )
 	SDL_Quit();
 	return 1;
 }
+
+#endif // HEADLESS